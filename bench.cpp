@@ -0,0 +1,479 @@
+//Benchmark of ReadLine++
+//
+//Drives the library through a pseudo terminal by scripted keystrokes and
+//prints results as JSON to stdout.
+//
+//usage: readlinepp_bench [--full]
+//
+//  --full     run also the largest cases (1M files, 10M history entries)
+
+#include "readlinepp.h"
+
+#include <readline/readline.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+using Clock = std::chrono::steady_clock;
+
+//Counting allocator - counts allocations made by the thread which enabled
+//counting (other threads, like terminal writers, are not counted). It wraps
+//glibc's internal entry points, so it is available only with glibc
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+extern "C" {
+void *__libc_malloc(std::size_t);
+void *__libc_calloc(std::size_t, std::size_t);
+void *__libc_realloc(void *, std::size_t);
+void __libc_free(void *);
+}
+
+static thread_local bool countAllocs = false;
+static thread_local std::size_t allocCount = 0;
+
+extern "C" void *malloc(std::size_t sz) {
+    if (countAllocs) ++allocCount;
+    return __libc_malloc(sz);
+}
+extern "C" void *calloc(std::size_t n, std::size_t sz) {
+    if (countAllocs) ++allocCount;
+    return __libc_calloc(n, sz);
+}
+extern "C" void *realloc(void *ptr, std::size_t sz) {
+    if (countAllocs) ++allocCount;
+    return __libc_realloc(ptr, sz);
+}
+extern "C" void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+///Counts allocations of current thread during its lifetime
+class AllocCounter {
+public:
+    AllocCounter():_start(allocCount) {countAllocs = true;}
+    ~AllocCounter() {countAllocs = false;}
+    std::size_t count() const {return allocCount - _start;}
+protected:
+    std::size_t _start;
+};
+#endif
+
+static double elapsedUs(Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration<double, std::micro>(to - from).count();
+}
+
+///Collects results and formats JSON
+class Report {
+public:
+    ///Starts new result object
+    Report &begin(const std::string &name) {
+        if (!_first) _out << ",\n";
+        _first = false;
+        _out << "    {\"name\":\"" << name << "\"";
+        return *this;
+    }
+    Report &add(const std::string &key, const std::string &value) {
+        _out << ",\"" << key << "\":\"" << value << "\"";
+        return *this;
+    }
+    Report &add(const std::string &key, double value) {
+        _out << ",\"" << key << "\":" << std::fixed << std::setprecision(3) << value;
+        return *this;
+    }
+    Report &add(const std::string &key, std::size_t value) {
+        _out << ",\"" << key << "\":" << value;
+        return *this;
+    }
+    ///Adds statistics of durations (us)
+    Report &stats(std::vector<double> &samples) {
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double d: samples) sum += d;
+        add("iterations", samples.size());
+        if (samples.empty()) return *this;
+        add("mean_us", sum/samples.size());
+        add("p50_us", samples[samples.size()/2]);
+        add("p99_us", samples[std::min(samples.size()-1, samples.size()*99/100)]);
+        add("max_us", samples.back());
+        return *this;
+    }
+    void end() {
+        _out << "}";
+        std::cerr << "." << std::flush;
+    }
+    std::string str() const {
+        return "{\n  \"benchmarks\": [\n" + _out.str() + "\n  ]\n}\n";
+    }
+protected:
+    std::ostringstream _out;
+    bool _first = true;
+};
+
+///Pseudo terminal connected to readline
+/**
+ * Keystrokes are written to the master side. Output of readline is
+ * drained by a background thread, so the terminal never blocks
+ */
+class PseudoTerminal {
+public:
+    PseudoTerminal() {
+        struct winsize ws = {};
+        ws.ws_row = 24;
+        ws.ws_col = 80;
+        if (openpty(&_master, &_slave, nullptr, nullptr, &ws) != 0) {
+            perror("openpty");
+            exit(1);
+        }
+        _in = fdopen(_slave, "r");
+        _out = fdopen(dup(_slave), "w");
+        _drain = std::thread([this]{
+            char buff[65536];
+            while (!_stop) {
+                struct pollfd pfd = {_master, POLLIN, 0};
+                if (poll(&pfd, 1, 50) > 0) {
+                    if (::read(_master, buff, sizeof(buff)) <= 0) break;
+                }
+            }
+        });
+    }
+    ~PseudoTerminal() {
+        _stop = true;
+        _drain.join();
+        fclose(_in);
+        fclose(_out);
+        close(_master);
+    }
+    ///Connects readline to this terminal
+    void attach() {
+        rl_instream = _in;
+        rl_outstream = _out;
+    }
+    ///Types keystrokes
+    void type(const std::string &keys) {
+        const char *p = keys.data();
+        std::size_t remain = keys.size();
+        while (remain) {
+            ssize_t r = ::write(_master, p, remain);
+            if (r <= 0) break;
+            p += r;
+            remain -= r;
+        }
+    }
+protected:
+    int _master = -1;
+    int _slave = -1;
+    FILE *_in = nullptr;
+    FILE *_out = nullptr;
+    std::atomic<bool> _stop{false};
+    std::thread _drain;
+};
+
+///Exposes internals needed by the benchmark
+class BenchReadLine: public ReadLine {
+public:
+    using ReadLine::ReadLine;
+    ///attaches instance (loads history)
+    void attach() {
+        run_locked([]{});
+    }
+    ///adds lines to the history
+    void addLines(const std::vector<std::string> &lines) {
+        run_locked([&]{
+            for (const auto &l: lines) addHistoryLine(l);
+        });
+    }
+};
+
+static std::string tempDir(const std::string &name) {
+    std::string path = "/tmp/readlinepp_bench_" + std::to_string(getpid()) + "_" + name;
+    mkdir(path.c_str(), 0700);
+    return path;
+}
+
+static void removeDir(const std::string &path) {
+    std::string cmd = "rm -rf '" + path + "'";
+    if (system(cmd.c_str()) != 0) {/* ignore */}
+}
+
+static std::string candidate(std::size_t i) {
+    char buff[32];
+    snprintf(buff, sizeof(buff), "item%07zu", i);
+    return buff;
+}
+
+static std::size_t iterationsFor(std::size_t n) {
+    return std::max<std::size_t>(5, std::min<std::size_t>(200, 2000000 / n));
+}
+
+///Measures read() of the line typed with TAB
+static void measureCompletion(Report &rep, PseudoTerminal &pty, ReadLine &rl,
+        const std::string &rule, std::size_t n, const std::string &keys) {
+    std::vector<double> samples;
+    std::string line;
+    std::size_t iters = iterationsFor(n);
+    for (std::size_t i = 0; i < iters; ++i) {
+        pty.type(keys);
+        auto t0 = Clock::now();
+        rl.read(line);
+        samples.push_back(elapsedUs(t0, Clock::now()));
+    }
+    rep.begin("completion").add("rule", rule).add("candidates", n).stats(samples).end();
+}
+
+static void benchCompletion(Report &rep, PseudoTerminal &pty, bool full) {
+    for (std::size_t n: {1000UL, 100000UL, 1000000UL}) {
+        std::vector<std::string> lst;
+        for (std::size_t i = 0; i < n; ++i) lst.push_back(candidate(i));
+        ReadLine rl;
+        rl.setCompletionList({{"", ReadLine::ProposalGenerator(std::move(lst))}});
+        //prefix matching 10 candidates
+        measureCompletion(rep, pty, rl, "list", n, "item" + candidate(n/2).substr(4, 6) + "\t\r");
+    }
+    for (std::size_t n: {1000UL, 100000UL, 1000000UL}) {
+        std::vector<std::string> lst;
+        for (std::size_t i = 0; i < n; ++i) lst.push_back(candidate(i));
+        ReadLine::CompletionList cl;
+        //rules which don't match, then the rule which matches with a submatch
+        for (int i = 0; i < 50; ++i) {
+            cl.push_back({ReadLine::Pattern(("cmd" + std::to_string(i) + " ([a-z]+) ").c_str()), {"x"}});
+        }
+        cl.push_back({"set ([a-z]+) ", ReadLine::ProposalGenerator(std::move(lst))});
+        ReadLine rl;
+        rl.setCompletionList(std::move(cl));
+        measureCompletion(rep, pty, rl, "regex", n, "set value item" + candidate(n/2).substr(4, 6) + "\t\r");
+    }
+    std::vector<std::size_t> file_sizes = {1000UL, 100000UL};
+    if (full) file_sizes.push_back(1000000UL);
+    for (std::size_t n: file_sizes) {
+        std::string dir = tempDir("files");
+        for (std::size_t i = 0; i < n; ++i) {
+            int fd = open((dir + "/" + candidate(i)).c_str(), O_CREAT|O_WRONLY, 0600);
+            if (fd >= 0) close(fd);
+        }
+        ReadLine rl;
+        rl.setCompletionList({{"", ReadLine::fileLookup(dir)}});
+        measureCompletion(rep, pty, rl, "file", n, "item" + candidate(n/2).substr(4, 6) + "\t\r");
+        removeDir(dir);
+    }
+}
+
+static void benchHistory(Report &rep, bool full) {
+    std::vector<std::size_t> sizes = {10000UL, 100000UL, 1000000UL};
+    if (full) sizes.push_back(10000000UL);
+    std::string dir = tempDir("history");
+    for (std::size_t n: sizes) {
+        std::string file = dir + "/history";
+        {
+            std::ofstream f(file, std::ios::trunc);
+            for (std::size_t i = 0; i < n; ++i) f << "command " << i << " with some arguments\n";
+        }
+        {
+            BenchReadLine rl;
+            rl.setHistoryFile(file);
+            auto t0 = Clock::now();
+            rl.attach();
+            rep.begin("history_load").add("entries", n).add("time_us", elapsedUs(t0, Clock::now())).end();
+        }
+        unlink(file.c_str());
+        {
+            std::vector<std::string> lines;
+            for (std::size_t i = 0; i < n; ++i) lines.push_back("command " + std::to_string(i) + " with some arguments");
+            BenchReadLine rl;
+            rl.setHistoryFile(file);
+            rl.attach();
+            rl.addLines(lines);
+            auto t0 = Clock::now();
+            rl.saveHistory();
+            rep.begin("history_save").add("entries", n).add("time_us", elapsedUs(t0, Clock::now())).end();
+        }
+        unlink(file.c_str());
+    }
+    removeDir(dir);
+}
+
+static void benchSwitch(Report &rep) {
+    for (std::size_t instances: {1UL, 2UL, 8UL}) {
+        for (std::size_t threads: {1UL, 4UL}) {
+            std::vector<std::unique_ptr<BenchReadLine> > rls;
+            std::vector<std::string> lines;
+            for (int i = 0; i < 100; ++i) lines.push_back("history line " + std::to_string(i));
+            for (std::size_t i = 0; i < instances; ++i) {
+                rls.push_back(std::make_unique<BenchReadLine>());
+                rls.back()->addLines(lines);
+            }
+            const std::size_t ops = 20000;
+            std::vector<std::thread> thr;
+            auto t0 = Clock::now();
+            for (std::size_t t = 0; t < threads; ++t) {
+                thr.emplace_back([&, t]{
+                    for (std::size_t i = 0; i < ops; ++i) {
+                        rls[(i + t) % instances]->attach();
+                    }
+                });
+            }
+            for (auto &t: thr) t.join();
+            double us = elapsedUs(t0, Clock::now());
+            rep.begin("run_locked_switch").add("instances", instances).add("threads", threads)
+                    .add("ops_per_sec", ops * threads / us * 1e6).end();
+        }
+    }
+}
+
+static void benchLineThroughput(Report &rep, PseudoTerminal &pty) {
+    const std::size_t lines = 20000;
+    {
+        ReadLine rl;
+        std::thread writer([&]{
+            std::string chunk;
+            for (std::size_t i = 0; i < lines; ++i) {
+                chunk.append("typed line number ").append(std::to_string(i)).append("\r");
+                if (chunk.size() > 1024) {
+                    pty.type(chunk);
+                    chunk.clear();
+                }
+            }
+            pty.type(chunk);
+        });
+        std::string line;
+        auto t0 = Clock::now();
+        for (std::size_t i = 0; i < lines; ++i) rl.read(line);
+        double us = elapsedUs(t0, Clock::now());
+        writer.join();
+        rep.begin("read_throughput").add("input", "tty").add("lines", lines)
+                .add("lines_per_sec", lines / us * 1e6).end();
+    }
+    {
+        const std::size_t script_lines = 2000000;
+        int p[2];
+        if (pipe(p) != 0) return;
+        FILE *saved = rl_instream;
+        FILE *in = fdopen(p[0], "r");
+        rl_instream = in;
+        std::thread writer([&]{
+            std::string chunk;
+            for (std::size_t i = 0; i < script_lines; ++i) {
+                chunk.append("script line number ").append(std::to_string(i)).append("\n");
+                if (chunk.size() > 65536) {
+                    if (::write(p[1], chunk.data(), chunk.size()) < 0) break;
+                    chunk.clear();
+                }
+            }
+            if (::write(p[1], chunk.data(), chunk.size()) < 0) {/* ignore */}
+            close(p[1]);
+        });
+        ReadLine rl;
+        std::string line;
+        std::size_t cnt = 0;
+        auto t0 = Clock::now();
+        while (rl.read(line)) ++cnt;
+        double us = elapsedUs(t0, Clock::now());
+        writer.join();
+        rl_instream = saved;
+        fclose(in);
+        rep.begin("read_throughput").add("input", "pipe").add("lines", cnt)
+                .add("lines_per_sec", cnt / us * 1e6).end();
+    }
+}
+
+#ifdef BENCH_COUNT_ALLOCS
+static void benchReadAllocations(Report &rep, PseudoTerminal &pty) {
+    //session repeats small set of commands, as usual for interactive use
+    const std::size_t warmup = 200;
+    const std::size_t lines = 5000;
+    auto command = [](std::size_t i) {
+        return "command --option " + std::to_string(i % 50);
+    };
+    ReadLineConfig cfg;
+    cfg.autosuggest = true;
+    {
+        ReadLine rl(cfg);
+        std::thread writer([&]{
+            std::string chunk;
+            for (std::size_t i = 0; i < warmup + lines; ++i) {
+                chunk.append(command(i)).append("\r");
+                if (chunk.size() > 1024) {
+                    pty.type(chunk);
+                    chunk.clear();
+                }
+            }
+            pty.type(chunk);
+        });
+        std::string line;
+        for (std::size_t i = 0; i < warmup; ++i) rl.read(line);
+        std::size_t allocs;
+        {
+            AllocCounter cnt;
+            for (std::size_t i = 0; i < lines; ++i) rl.read(line);
+            allocs = cnt.count();
+        }
+        writer.join();
+        rep.begin("read_allocations").add("input", "tty").add("lines", lines)
+                .add("allocs_per_line", static_cast<double>(allocs) / lines).end();
+    }
+    for (bool history: {false, true}) {
+        int p[2];
+        if (pipe(p) != 0) return;
+        FILE *saved = rl_instream;
+        FILE *in = fdopen(p[0], "r");
+        rl_instream = in;
+        std::thread writer([&]{
+            std::string chunk;
+            for (std::size_t i = 0; i < warmup + lines; ++i) chunk.append(command(i)).append("\n");
+            if (::write(p[1], chunk.data(), chunk.size()) < 0) {/* ignore */}
+            close(p[1]);
+        });
+        cfg.script_history = history;
+        ReadLine rl(cfg);
+        std::string line;
+        for (std::size_t i = 0; i < warmup; ++i) rl.read(line);
+        std::size_t allocs;
+        {
+            AllocCounter cnt;
+            for (std::size_t i = 0; i < lines; ++i) rl.read(line);
+            allocs = cnt.count();
+        }
+        writer.join();
+        rl_instream = saved;
+        fclose(in);
+        rep.begin("read_allocations").add("input", history?"pipe+history":"pipe").add("lines", lines)
+                .add("allocs_per_line", static_cast<double>(allocs) / lines).end();
+    }
+}
+#endif
+
+int main(int argc, char **argv) {
+    bool full = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--full") == 0) full = true;
+        else {
+            std::cerr << "usage: " << argv[0] << " [--full]" << std::endl;
+            return 1;
+        }
+    }
+    Report rep;
+    PseudoTerminal pty;
+    pty.attach();
+    benchCompletion(rep, pty, full);
+    benchHistory(rep, full);
+    benchSwitch(rep);
+    benchLineThroughput(rep, pty);
+#ifdef BENCH_COUNT_ALLOCS
+    benchReadAllocations(rep, pty);
+#endif
+    std::cerr << std::endl;
+    std::cout << rep.str();
+    return 0;
+}
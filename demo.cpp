@@ -30,12 +30,14 @@ int main(int argv, char **argc) {
     std::cout << "ReadLine++ demo. Try press TAB twice. To exit press Ctrl+D" << std::endl;
     rl.setPrompt(">");
     rl.setCompletionList({
-        {"",{"hello","hi","file","csource"}},
+        {"",{"hello","hi","file","csource","exec","find"}},
         {"hello ",{"world!","universe!","people!"}},
         {"hi ",{"ondra","franta"}},
         {"file ",ReadLine::fileLookup(".")},
         {"csource ",ReadLine::fileLookup(".",".*\\.c|.*\\.cpp|.*\\.h|.*\\/")},
         {"csource ([^ ]+) ",extractFile(".")},
+        {"exec ",ReadLine::executableLookup()},
+        {"find ",ReadLine::recursiveFileLookup(".")},
     });
     rl.setAppName("rldemo");
     std::string line;
@@ -0,0 +1,99 @@
+#include "historyindex.h"
+#include "historysnapshot.h"
+
+#include <algorithm>
+
+std::vector<std::unique_ptr<HistoryIndex::Node> >::const_iterator HistoryIndex::findChild(const Node &nd, char c) {
+    //children are ordered by first character, and there is only one child for each character
+    auto iter = std::lower_bound(nd.children.begin(), nd.children.end(), c,
+            [](const std::unique_ptr<Node> &n, char c) {return n->label[0] < c;});
+    if (iter != nd.children.end() && (*iter)->label[0] == c) return iter;
+    return nd.children.end();
+}
+
+void HistoryIndex::add(const char *line, std::size_t len) {
+    insert(line, len, true);
+}
+
+void HistoryIndex::addOlder(const char *line, std::size_t len) {
+    insert(line, len, false);
+}
+
+void HistoryIndex::insert(const char *line, std::size_t len, bool recent) {
+    //lookup by reused key first, emplace would allocate node even for known line
+    _key.assign(line, len);
+    auto known = _lines.find(_key);
+    if (known != _lines.end() && !recent) {
+        //more recent occurrence already covers all prefixes
+        return;
+    }
+    const std::string *s = known != _lines.end()?&(*known):&(*_lines.insert(_key).first);
+    const char *text = s->data();
+    Node *nd = &_root;
+    std::size_t pos = 0;
+    while (true) {
+        if (recent || !nd->best) nd->best = s;
+        if (pos == len) break;
+        auto iter = findChild(*nd, text[pos]);
+        if (iter == nd->children.end()) {
+            //no child for this character, create leaf and we are done
+            auto leaf = std::make_unique<Node>();
+            leaf->label = text+pos;
+            leaf->label_len = len-pos;
+            leaf->best = s;
+            auto ins = std::lower_bound(nd->children.begin(), nd->children.end(), text[pos],
+                    [](const std::unique_ptr<Node> &n, char c) {return n->label[0] < c;});
+            nd->children.insert(ins, std::move(leaf));
+            break;
+        }
+        Node *ch = iter->get();
+        std::size_t remain = std::min(ch->label_len, len-pos);
+        std::size_t common = 1;
+        while (common < remain && ch->label[common] == text[pos+common]) ++common;
+        if (common < ch->label_len) {
+            //split the child - the tail of the label goes to the new node
+            auto tail = std::make_unique<Node>();
+            tail->label = ch->label+common;
+            tail->label_len = ch->label_len-common;
+            tail->best = ch->best;
+            tail->children = std::move(ch->children);
+            ch->label_len = common;
+            ch->children.clear();
+            ch->children.push_back(std::move(tail));
+        }
+        nd = ch;
+        pos += common;
+    }
+}
+
+bool HistoryIndex::find(const char *prefix, std::size_t len, const char *&line, std::size_t &line_len) const {
+    const std::string *s = findLine(prefix, len);
+    if (s) {
+        line = s->data();
+        line_len = s->size();
+        return true;
+    }
+    return _base && _base->find(prefix, len, line, line_len);
+}
+
+const std::string *HistoryIndex::findLine(const char *prefix, std::size_t len) const {
+    const Node *nd = &_root;
+    std::size_t pos = 0;
+    while (pos < len) {
+        auto iter = findChild(*nd, prefix[pos]);
+        if (iter == nd->children.end()) return nullptr;
+        const Node *ch = iter->get();
+        std::size_t cmp = std::min(ch->label_len, len-pos);
+        if (std::char_traits<char>::compare(ch->label, prefix+pos, cmp) != 0) return nullptr;
+        pos += cmp;
+        nd = ch;
+    }
+    return nd->best;
+}
+
+void HistoryIndex::clear() {
+    _root.children.clear();
+    _root.best = nullptr;
+    _lines.clear();
+    _base.reset();
+}
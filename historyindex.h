@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+
+class HistorySnapshot;
+
+///Prefix index over history lines
+/**
+ * The index is compressed prefix tree (radix tree). Every node remembers
+ * the most recent line passing through it, so lookup of the most recent
+ * line starting by given prefix costs O(length of prefix) regardless of
+ * count of lines in the history.
+ *
+ * The index is maintained incrementally. Each added line becomes
+ * the most recent line for all its prefixes. Lines are never removed,
+ * so the index can suggest a line which has been already removed from
+ * stifled history.
+ *
+ * The index can have a base - the history snapshot which contains
+ * prebuilt index of older lines. Lines added to the index are always
+ * more recent than lines in the snapshot.
+ *
+ * The object is not MT safe
+ */
+class HistoryIndex {
+public:
+
+    ///Add line to the index (line becomes the most recent)
+    /**
+     * @param line pointer to line
+     * @param len length of the line
+     */
+    void add(const char *line, std::size_t len);
+
+    ///Add line older than all lines already in the index
+    /**
+     * Allows to build the index incrementally from the most recent line
+     * to the oldest one. The line becomes result only for prefixes, which
+     * are not covered by more recent lines
+     *
+     * @param line pointer to line
+     * @param len length of the line
+     */
+    void addOlder(const char *line, std::size_t len);
+
+    ///Find most recent line starting by given prefix
+    /**
+     * @param prefix prefix
+     * @param len length of prefix
+     * @param line receives pointer to the most recent line which starts by the prefix.
+     * Pointer is valid until the index is cleared or destroyed
+     * @param line_len receives length of the line
+     * @retval true found
+     * @retval false there is no such line
+     */
+    bool find(const char *prefix, std::size_t len, const char *&line, std::size_t &line_len) const;
+
+    ///Set base snapshot (contains lines older than lines in the index)
+    void setBase(std::shared_ptr<const HistorySnapshot> base) {_base = std::move(base);}
+
+    ///Clear the index (including base)
+    void clear();
+
+    ///Count of distinct lines in the index
+    std::size_t size() const {return _lines.size();}
+
+protected:
+
+    struct Node {
+        ///label - points into one of lines in the pool
+        const char *label = nullptr;
+        ///length of the label
+        std::size_t label_len = 0;
+        ///most recent line passing through this node
+        const std::string *best = nullptr;
+        ///children ordered by first character of the label
+        std::vector<std::unique_ptr<Node> > children;
+    };
+
+    Node _root;
+    ///pool of lines - node based container keeps pointers stable
+    std::unordered_set<std::string> _lines;
+    ///snapshot with older lines
+    std::shared_ptr<const HistorySnapshot> _base;
+    ///buffer for lookup key (avoids allocation for lines already in the pool)
+    std::string _key;
+
+    const std::string *findLine(const char *prefix, std::size_t len) const;
+    ///inserts line, recent = line is the most recent, otherwise it is the oldest
+    void insert(const char *line, std::size_t len, bool recent);
+
+    static std::vector<std::unique_ptr<Node> >::const_iterator findChild(const Node &nd, char c);
+};
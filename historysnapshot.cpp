@@ -0,0 +1,206 @@
+#include "historysnapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static constexpr char snapshotMagic[8] = {'R','L','P','P','S','N','A','P'};
+static constexpr std::uint32_t snapshotVersion = 1;
+
+//all fields are 8 bytes aligned, the tables follow the header
+struct HistorySnapshot::Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    ///size of the history file
+    std::uint64_t source_size;
+    ///modification time of the history file
+    std::int64_t source_mtime_sec;
+    std::int64_t source_mtime_nsec;
+    ///count of entries
+    std::uint64_t count;
+    ///count of distinct entries
+    std::uint64_t distinct;
+    ///size of whole snapshot file
+    std::uint64_t file_size;
+};
+
+bool HistorySnapshot::source(const std::string &history_file, Source &src) {
+    struct stat st;
+    if (stat(history_file.c_str(), &st) != 0) {
+        //history file doesn't exist
+        src = Source();
+        return errno == ENOENT;
+    }
+    src.size = st.st_size;
+    src.mtime_sec = st.st_mtim.tv_sec;
+    src.mtime_nsec = st.st_mtim.tv_nsec;
+    return true;
+}
+
+std::shared_ptr<const HistorySnapshot> HistorySnapshot::open(const std::string &file, const std::string &history_file) {
+    Source src;
+    if (!source(history_file, src)) return nullptr;
+    int fd = ::open(file.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+        close(fd);
+        return nullptr;
+    }
+    void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return nullptr;
+    std::shared_ptr<HistorySnapshot> snap(new HistorySnapshot);
+    snap->_map = m;
+    snap->_map_size = st.st_size;
+
+    const Header *hdr = static_cast<const Header *>(m);
+    if (std::memcmp(hdr->magic, snapshotMagic, sizeof(snapshotMagic)) != 0
+            || hdr->version != snapshotVersion
+            || hdr->file_size != static_cast<std::uint64_t>(st.st_size)
+            || hdr->source_size != src.size || hdr->source_mtime_sec != src.mtime_sec
+            || hdr->source_mtime_nsec != src.mtime_nsec) {
+        return nullptr;
+    }
+    //limit counts first, so the size of the tables cannot overflow
+    if (hdr->count >= hdr->file_size / sizeof(std::uint64_t)
+            || hdr->count > std::numeric_limits<std::uint32_t>::max()
+            || hdr->distinct > hdr->count) {
+        return nullptr;
+    }
+    std::uint64_t tables = sizeof(Header) + (hdr->count+1) * sizeof(std::uint64_t)
+            + hdr->distinct * 3 * sizeof(std::uint32_t);
+    if (tables > hdr->file_size) return nullptr;
+    const char *base = static_cast<const char *>(m);
+    snap->_count = hdr->count;
+    snap->_distinct = hdr->distinct;
+    snap->_offsets = reinterpret_cast<const std::uint64_t *>(base + sizeof(Header));
+    snap->_order = reinterpret_cast<const std::uint32_t *>(snap->_offsets + hdr->count + 1);
+    snap->_tree = snap->_order + hdr->distinct;
+    snap->_data = base + tables;
+    if (!snap->valid(hdr->file_size - tables)) return nullptr;
+    return snap;
+}
+
+bool HistorySnapshot::valid(std::uint64_t data_size) const {
+    //each entry has at least the terminating zero, so offsets must increase
+    if (_offsets[0] != 0 || _offsets[_count] > data_size) return false;
+    for (std::size_t i = 0; i < _count; ++i) {
+        if (_offsets[i] >= _offsets[i+1] || _data[_offsets[i+1]-1] != 0) return false;
+    }
+    //order and tree contain indexes of entries
+    auto in_range = [&](std::uint32_t idx) {return idx < _count;};
+    return std::all_of(_order, _order + _distinct, in_range)
+            && std::all_of(_tree, _tree + 2 * _distinct, in_range);
+}
+
+HistorySnapshot::~HistorySnapshot() {
+    if (_map) munmap(_map, _map_size);
+}
+
+bool HistorySnapshot::write(const std::string &file, const Source &src, const std::vector<const char *> &entries) {
+    Header hdr = {};
+    std::memcpy(hdr.magic, snapshotMagic, sizeof(snapshotMagic));
+    hdr.version = snapshotVersion;
+    hdr.source_size = src.size;
+    hdr.source_mtime_sec = src.mtime_sec;
+    hdr.source_mtime_nsec = src.mtime_nsec;
+    hdr.count = entries.size();
+
+    std::vector<std::uint64_t> offsets;
+    offsets.reserve(entries.size()+1);
+    std::uint64_t pos = 0;
+    for (const char *e: entries) {
+        offsets.push_back(pos);
+        pos += std::strlen(e) + 1;
+    }
+    offsets.push_back(pos);
+
+    //distinct entries (the most recent occurrence) ordered by text
+    std::vector<std::uint32_t> order(entries.size());
+    for (std::uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b){
+        return std::strcmp(entries[a], entries[b]) < 0;
+    });
+    std::vector<std::uint32_t> distinct;
+    distinct.reserve(order.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        //stable sort keeps the most recent duplicate last
+        if (i + 1 < order.size() && std::strcmp(entries[order[i]], entries[order[i+1]]) == 0) continue;
+        distinct.push_back(order[i]);
+    }
+    hdr.distinct = distinct.size();
+    //range-maximum tree - bigger index means more recent entry
+    std::size_t m = distinct.size();
+    std::vector<std::uint32_t> tree(2*m);
+    std::copy(distinct.begin(), distinct.end(), tree.begin()+m);
+    for (std::size_t i = m; i-- > 1;) tree[i] = std::max(tree[2*i], tree[2*i+1]);
+
+    hdr.file_size = sizeof(Header) + offsets.size() * sizeof(std::uint64_t)
+            + (distinct.size() + tree.size()) * sizeof(std::uint32_t) + pos;
+
+    //write to temporary file and rename, so mapped snapshot is never overwritten
+    std::string tmp = file + ".tmp" + std::to_string(getpid());
+    int fd = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+    std::vector<char> buffer;
+    buffer.reserve(hdr.file_size);
+    auto put = [&](const void *data, std::size_t sz) {
+        const char *c = static_cast<const char *>(data);
+        buffer.insert(buffer.end(), c, c+sz);
+    };
+    put(&hdr, sizeof(hdr));
+    put(offsets.data(), offsets.size() * sizeof(std::uint64_t));
+    put(distinct.data(), distinct.size() * sizeof(std::uint32_t));
+    put(tree.data(), tree.size() * sizeof(std::uint32_t));
+    for (const char *e: entries) put(e, std::strlen(e)+1);
+    const char *p = buffer.data();
+    std::size_t remain = buffer.size();
+    bool ok = true;
+    while (remain && ok) {
+        ssize_t r = ::write(fd, p, remain);
+        if (r < 0) {
+            ok = errno == EINTR;
+        } else {
+            p += r;
+            remain -= r;
+        }
+    }
+    ok = close(fd) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), file.c_str()) == 0;
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+}
+
+bool HistorySnapshot::find(const char *prefix, std::size_t len, const char *&line, std::size_t &line_len) const {
+    if (_distinct == 0) return false;
+    const std::uint32_t *order_end = _order + _distinct;
+    //first entry not less than prefix
+    const std::uint32_t *lo = std::lower_bound(_order, order_end, 0U, [&](std::uint32_t e, std::uint32_t){
+        return std::strncmp(entry(e), prefix, len) < 0;
+    });
+    //first entry which doesn't start by prefix
+    const std::uint32_t *hi = std::upper_bound(lo, order_end, 0U, [&](std::uint32_t, std::uint32_t e){
+        return std::strncmp(entry(e), prefix, len) > 0;
+    });
+    if (lo == hi) return false;
+    //range maximum query on <lo,hi)
+    std::uint32_t best = 0;
+    std::size_t l = (lo - _order) + _distinct;
+    std::size_t r = (hi - _order) + _distinct;
+    while (l < r) {
+        if (l & 1) best = std::max(best, _tree[l++]);
+        if (r & 1) best = std::max(best, _tree[--r]);
+        l >>= 1;
+        r >>= 1;
+    }
+    line = entry(best);
+    line_len = entryLength(best);
+    return true;
+}
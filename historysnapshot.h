@@ -0,0 +1,105 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+///Binary snapshot of the history, mapped to the memory
+/**
+ * The snapshot contains history entries and prebuilt prefix index
+ * (entries sorted by text with range-maximum tree of recency), so the
+ * most recent entry starting by a prefix can be found directly in the mapped
+ * file in O(log n) without building HistoryIndex.
+ *
+ * The snapshot remembers size and modification time of the history file
+ * it was created from. If the history file has been changed since, the snapshot
+ * is stale and it is not opened.
+ */
+class HistorySnapshot {
+public:
+
+    ///Open snapshot
+    /**
+     * @param file snapshot file
+     * @param history_file history file which the snapshot must match
+     * @return snapshot, or nullptr if the snapshot doesn't exist, is invalid or stale
+     */
+    static std::shared_ptr<const HistorySnapshot> open(const std::string &file, const std::string &history_file);
+
+    ///State of the history file, the snapshot is valid while it is not changed
+    struct Source {
+        std::uint64_t size = 0;
+        std::int64_t mtime_sec = -1;
+        std::int64_t mtime_nsec = -1;
+        bool operator==(const Source &other) const {
+            return size == other.size && mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec;
+        }
+        bool operator!=(const Source &other) const {return !operator==(other);}
+    };
+
+    ///Retrieve state of the history file
+    /**
+     * @param history_file history file
+     * @param src receives the state (a missing file is valid empty source)
+     * @retval true success
+     * @retval false failed to stat the file
+     */
+    static bool source(const std::string &history_file, Source &src);
+
+    ///Write snapshot
+    /**
+     * @param file snapshot file
+     * @param src state of the history file at time the entries were read from it
+     * @param entries entries of the history file ordered from least recent to most recent
+     * @retval true written
+     * @retval false failed
+     */
+    static bool write(const std::string &file, const Source &src, const std::vector<const char *> &entries);
+
+    ~HistorySnapshot();
+    HistorySnapshot(const HistorySnapshot &) = delete;
+    HistorySnapshot &operator=(const HistorySnapshot &) = delete;
+
+    ///Count of entries
+    std::size_t size() const {return _count;}
+    ///Entry (null terminated)
+    const char *entry(std::size_t idx) const {return _data + _offsets[idx];}
+    ///Length of entry
+    std::size_t entryLength(std::size_t idx) const {return _offsets[idx+1] - _offsets[idx] - 1;}
+
+    ///Find most recent entry starting by prefix
+    /**
+     * @param prefix prefix
+     * @param len length of prefix
+     * @param line receives pointer to the entry
+     * @param line_len receives length of the entry
+     * @retval true found
+     * @retval false not found
+     */
+    bool find(const char *prefix, std::size_t len, const char *&line, std::size_t &line_len) const;
+
+protected:
+    struct Header;
+
+    HistorySnapshot() = default;
+
+    ///checks that the tables don't point out of the mapped file
+    /**
+     * @param data_size size of the data area
+     * @retval true valid
+     * @retval false corrupted
+     */
+    bool valid(std::uint64_t data_size) const;
+
+    void *_map = nullptr;
+    std::size_t _map_size = 0;
+    std::size_t _count = 0;
+    ///count of distinct entries
+    std::size_t _distinct = 0;
+    const std::uint64_t *_offsets = nullptr;
+    ///distinct entries ordered by text
+    const std::uint32_t *_order = nullptr;
+    ///range-maximum tree of entry indexes over _order (leaves at _distinct.._distinct*2-1)
+    const std::uint32_t *_tree = nullptr;
+    const char *_data = nullptr;
+};
@@ -1,4 +1,7 @@
 #include "readlinepp.h"
+#include "historyindex.h"
+#include "historysnapshot.h"
+#include "sharedhistory.h"
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -8,11 +11,62 @@
 #include <pwd.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <poll.h>
 
 
 std::recursive_mutex ReadLine::gmx;
 ReadLine *ReadLine::curInst = nullptr;
 
+struct ReadLine::PrintItem {
+    std::string text;
+    PrintItem *next;
+};
+
+std::atomic<ReadLine::PrintItem *> ReadLine::printQueue(nullptr);
+std::atomic<bool> ReadLine::metricsOn(false);
+
+///global metrics
+static struct {
+    ReadLine::Histogram regex_match;
+    ReadLine::Histogram generator;
+    ReadLine::Histogram proposals;
+    ReadLine::Histogram common_prefix;
+    ReadLine::Histogram lock_wait;
+    ReadLine::Histogram lock_hold;
+    ReadLine::Histogram state_save;
+    ReadLine::Histogram state_restore;
+    ReadLine::Histogram history_load;
+    ReadLine::Histogram history_save;
+} globalMetrics;
+
+using MetricsClock = std::chrono::steady_clock;
+
+static std::uint64_t elapsedNs(MetricsClock::time_point from, MetricsClock::time_point to) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+}
+///true while readline() is active
+static std::atomic<bool> readingActive(false);
+///true while the proposals are displayed (paging prompt can be active)
+static bool displayingProposals = false;
+///serializes direct output of print() and changes of readingActive
+static std::mutex printMx;
+///pipe which wakes the reading thread
+static int printWakeFd[2] = {-1, -1};
+///time of last redraw caused by print
+static std::chrono::steady_clock::time_point lastPrintRedraw;
+
+///rl_sort_completion_matches before keepProposalOrder() (-1 = not changed)
+static int sortMatchesSaved = -1;
+
+void ReadLine::keepProposalOrder() {
+    if (sortMatchesSaved < 0) sortMatchesSaved = rl_sort_completion_matches;
+    rl_sort_completion_matches = 0;
+}
+
 //THIS UGLY C-HYBRID FUNCTION IS BRIDGE BETWEEN UGLY C INTERFACE AND C++ INTERFACE
 //function is super global
 char **ReadLine::global_completion (const char *, int start, int end) {
@@ -25,10 +79,17 @@ char **ReadLine::global_completion (const char *, int start, int end) {
         _compl_tmp.push_back(allocProposalItem(sug));
     };
 
+    //previous completion could disable sorting
+    if (sortMatchesSaved >= 0) {
+        rl_sort_completion_matches = sortMatchesSaved;
+        sortMatchesSaved = -1;
+    }
     if (curInst) {
         _compl_tmp.clear();
         if (curInst->onComplete(rl_line_buffer, start, end, _compl_cb)) {
             char **list;
+            bool measure = metricsEnabled();
+            if (measure) globalMetrics.proposals.record(_compl_tmp.size());
             //this is over
             rl_attempted_completion_over = 1;
             //this function contains bunch of C patterns - UNSAFE CODE!
@@ -60,6 +121,8 @@ char **ReadLine::global_completion (const char *, int start, int end) {
                 list = reinterpret_cast<char **>(calloc(_compl_tmp.size()+2,sizeof(char *)));
 
                 //we must compute common part of all matches
+                MetricsClock::time_point tm;
+                if (measure) tm = MetricsClock::now();
                 std::size_t common = std::numeric_limits<std::size_t>::max();
                 for (const auto &x: _compl_tmp) {
                     char *z1 = x.get();
@@ -69,8 +132,17 @@ char **ReadLine::global_completion (const char *, int start, int end) {
                     common = l;
                     if (common == 0) break;
                 }
+                if (measure) globalMetrics.common_prefix.record(elapsedNs(tm, MetricsClock::now()));
+                //if proposals don't start by the word (substring or fuzzy match)
+                //keep the word, otherwise it would be replaced by the common part
+                const char *comsrc = _compl_tmp[0].get();
+                std::size_t wlen = end - start;
+                if (common < wlen || std::strncmp(comsrc, rl_line_buffer+start, wlen) != 0) {
+                    comsrc = rl_line_buffer+start;
+                    common = wlen;
+                }
                 char *comstr = static_cast<char *>(malloc(common+1));
-                strncpy(comstr, _compl_tmp[0].get(), common);
+                strncpy(comstr, comsrc, common);
                 comstr[common] = 0;
                 list[0] = comstr;
 
@@ -99,7 +171,270 @@ char *ReadLine::completion_word_break_hook() {
     if (curInst) {
         return const_cast<char *>(curInst->completionWordBreakHook(rl_line_buffer, rl_end, rl_point));
     } else {
-        return rl_completer_word_break_characters;
+        return const_cast<char *>(rl_completer_word_break_characters);
+    }
+}
+
+//counts columns occupied by the text - counts UTF-8 characters and skips
+//invisible parts of the prompt
+static std::size_t displayWidth(const char *text, std::size_t size) {
+    std::size_t w = 0;
+    bool invisible = false;
+    for (std::size_t i = 0; i < size; ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c == RL_PROMPT_START_IGNORE) invisible = true;
+        else if (c == RL_PROMPT_END_IGNORE) invisible = false;
+        else if (!invisible && (c & 0xC0) != 0x80) ++w;
+    }
+    return w;
+}
+
+void ReadLine::display_matches_hook(char **matches, int num_matches, int max_length) {
+    if (curInst) {
+        //matches[0] contains substitution, proposals start at index 1
+        //printed texts are held back, redraw would break the paging prompt
+        displayingProposals = true;
+        curInst->displayProposals(matches+1, num_matches);
+        displayingProposals = false;
+    } else {
+        rl_display_match_list(matches, num_matches, max_length);
+    }
+}
+
+void ReadLine::displayProposals(const char * const *proposals, std::size_t count) {
+    int screen_rows, screen_cols;
+    rl_get_screen_size(&screen_rows, &screen_cols);
+    //one row is reserved for paging prompt
+    std::size_t page_rows = std::max(screen_rows-1, 1);
+    std::size_t width = std::max(screen_cols, 1);
+    std::vector<std::size_t> widths;
+
+    rl_crlf();
+    std::size_t pos = 0;
+    while (pos < count) {
+        std::size_t remain = count - pos;
+        //estimate column width from a sample, then fit the page and
+        //recompute width from entries which are really visible. The width
+        //can only grow, so the page can only shrink and the loop ends
+        std::size_t colw = 0;
+        std::size_t page = std::min<std::size_t>(remain, 256);
+        std::size_t cols = 1;
+        widths.clear();
+        while (true) {
+            for (std::size_t i = widths.size(); i < page; ++i) {
+                widths.push_back(displayWidth(proposals[pos+i], std::strlen(proposals[pos+i])));
+            }
+            std::size_t w = colw;
+            for (std::size_t i = 0; i < page; ++i) w = std::max(w, widths[i]+2);
+            bool stable = w == colw;
+            colw = w;
+            cols = std::max<std::size_t>(width / colw, 1);
+            std::size_t capacity = cols * page_rows;
+            if (capacity < page) page = capacity;
+            else if (stable || page == remain) {
+                if (page == std::min(remain, capacity)) break;
+                page = std::min(remain, capacity);
+            }
+        }
+        std::size_t rows = (page + cols - 1) / cols;
+        for (std::size_t r = 0; r < rows; ++r) {
+            for (std::size_t c = 0; c < cols; ++c) {
+                std::size_t idx = c * rows + r;
+                if (idx >= page) break;
+                const char *p = proposals[pos+idx];
+                fputs(p, rl_outstream);
+                if (c + 1 < cols && idx + rows < page) {
+                    for (std::size_t i = widths[idx]; i < colw; ++i) fputc(' ', rl_outstream);
+                }
+            }
+            rl_crlf();
+        }
+        pos += page;
+        if (pos < count) {
+            fprintf(rl_outstream, "--More-- (%zu/%zu)", pos, count);
+            fflush(rl_outstream);
+            int k = rl_read_key();
+            fputs("\r\x1b[K", rl_outstream);
+            if (k != ' ' && k != 'y' && k != 'Y' && k != '\r' && k != '\n') break;
+        }
+    }
+    fflush(rl_outstream);
+    rl_forced_update_display();
+}
+
+void ReadLine::global_redisplay() {
+    rl_redisplay();
+    if (curInst && curInst->_config.autosuggest) {
+        curInst->drawSuggestion();
+    }
+}
+
+void ReadLine::drawSuggestion() {
+    bool show = rl_point == rl_end && rl_end > 0
+            && !RL_ISSTATE(RL_STATE_ISEARCH|RL_STATE_NSEARCH|RL_STATE_SEARCH|RL_STATE_NUMERICARG)
+            && onSuggest(rl_line_buffer, rl_end, _suggestion)
+            && !_suggestion.empty();
+    if (show) {
+        //suggestion is displayed only when it fits to the current row,
+        //so we are able to return cursor back
+        int rows, cols;
+        rl_get_screen_size(&rows, &cols);
+        const char *prompt = rl_display_prompt?rl_display_prompt:"";
+        std::size_t col = displayWidth(prompt, std::strlen(prompt))
+                + displayWidth(rl_line_buffer, rl_end);
+        if (cols <= 0 || col + 1 >= static_cast<std::size_t>(cols)) {
+            show = false;
+        } else {
+            std::size_t avail = cols - col - 1;
+            std::size_t len = 0, w = 0;
+            while (len < _suggestion.size()) {
+                if ((_suggestion[len] & 0xC0) != 0x80) {
+                    if (w == avail) break;
+                    ++w;
+                }
+                ++len;
+            }
+            fprintf(rl_outstream, "\x1b[K\x1b[90m%.*s\x1b[0m\x1b[%zuD",
+                    static_cast<int>(len), _suggestion.c_str(), w);
+            fflush(rl_outstream);
+            _suggestion_shown = true;
+            return;
+        }
+    }
+    _suggestion.clear();
+    if (_suggestion_shown) {
+        //remove suggestion from the screen
+        std::size_t w = displayWidth(rl_line_buffer+rl_point, rl_end-rl_point);
+        if (w) fprintf(rl_outstream, "\x1b[%zuC\x1b[K\x1b[%zuD", w, w);
+        else fputs("\x1b[K", rl_outstream);
+        fflush(rl_outstream);
+        _suggestion_shown = false;
+    }
+}
+
+bool ReadLine::onSuggest(const char *line, std::size_t size, std::string &suggestion) {
+    if (!_history_index) return false;
+    const char *s;
+    std::size_t len;
+    if (!_history_index->find(line, size, s, len) || len <= size) return false;
+    suggestion.assign(s+size, len-size);
+    return true;
+}
+
+int ReadLine::accept_suggestion(int count, int key) {
+    if (curInst && curInst->_suggestion_shown && !curInst->_suggestion.empty() && rl_point == rl_end) {
+        rl_insert_text(curInst->_suggestion.c_str());
+        return 0;
+    }
+    return rl_forward_char(count, key);
+}
+
+int ReadLine::accept_line(int count, int key) {
+    if (curInst && curInst->_suggestion_shown) {
+        //suggestion must be removed, otherwise it stays on the screen
+        curInst->_suggestion_shown = false;
+        fputs("\x1b[K", rl_outstream);
+        fflush(rl_outstream);
+    }
+    return rl_newline(count, key);
+}
+
+int ReadLine::bracketed_paste(int, int) {
+    //readline's own handler converts each CR to LF, so CRLF would become
+    //two line separators and readBatch() would return an extra empty line
+    static const char suffix[] = "\033[201~";
+    constexpr std::size_t suffix_len = sizeof(suffix)-1;
+    std::string text;
+    std::size_t matched = 0;
+    bool cr = false;
+    RL_SETSTATE(RL_STATE_MOREINPUT);
+    while (matched < suffix_len) {
+        int c = rl_read_key();
+        if (c < 0) break;
+        if (c == suffix[matched]) {
+            ++matched;
+            continue;
+        }
+        if (matched) {
+            //only the first character of the suffix is ESC
+            text.append(suffix, matched);
+            cr = false;
+            matched = c == suffix[0]?1:0;
+            if (matched) continue;
+        }
+        if (c == '\n' && cr) {
+            cr = false;
+            continue;
+        }
+        cr = c == '\r';
+        text.push_back(cr?'\n':static_cast<char>(c));
+    }
+    RL_UNSETSTATE(RL_STATE_MOREINPUT);
+    rl_mark = rl_point;
+    int r = rl_insert_text(text.c_str()) == static_cast<int>(text.size())?0:1;
+    const char *active = rl_variable_value("enable-active-region");
+    if (active && std::strcmp(active, "on") == 0) rl_activate_mark();
+    return r;
+}
+
+///count of history lines indexed in one step
+static constexpr int indexStepLines = 1024;
+
+void ReadLine::buildHistoryIndex() {
+    _history_index = std::make_unique<HistoryIndex>();
+    int skip = 0;
+    //lines from the snapshot are already indexed by the snapshot, unless
+    //the stifled history dropped some of them
+    if (_snapshot && _snapshot_history_length >= 0 && history_length >= _snapshot_history_length
+            && (!history_is_stifled() || history_length < history_max_entries)) {
+        _history_index->setBase(_snapshot);
+        skip = _snapshot_history_length;
+    }
+    //the rest is indexed while waiting for input, the most recent lines first
+    _index_begin = skip;
+    _index_end = std::max(history_length, skip);
+    indexHistoryStep();
+}
+
+bool ReadLine::indexHistoryStep() {
+    if (!_history_index || _index_end <= _index_begin) return false;
+    HIST_ENTRY **lst = history_list();
+    int stop = std::max(_index_begin, _index_end - indexStepLines);
+    while (_index_end > stop) {
+        --_index_end;
+        const char *line = lst[_index_end]->line;
+        _history_index->addOlder(line, std::strlen(line));
+    }
+    return _index_end > _index_begin;
+}
+
+///keys rebound to accept suggestion (sequence and original function)
+static std::vector<std::pair<const char *, rl_command_func_t *> > suggestionKeys;
+static bool suggestionKeysBound = false;
+
+void ReadLine::bindSuggestionKeys(bool enable) {
+    if (enable == suggestionKeysBound) return;
+    suggestionKeysBound = enable;
+    if (enable) {
+        //replace default bindings only, keep bindings customized by inputrc
+        for (const char *seq: {"\033[C", "\033OC", "\006"}) {
+            if (rl_function_of_keyseq(seq, nullptr, nullptr) == &rl_forward_char) {
+                rl_bind_keyseq(seq, &accept_suggestion);
+                suggestionKeys.emplace_back(seq, &rl_forward_char);
+            }
+        }
+        for (const char *seq: {"\r", "\n"}) {
+            if (rl_function_of_keyseq(seq, nullptr, nullptr) == &rl_newline) {
+                rl_bind_keyseq(seq, &accept_line);
+                suggestionKeys.emplace_back(seq, &rl_newline);
+            }
+        }
+    } else {
+        for (const auto &k: suggestionKeys) {
+            rl_command_func_t *cur = rl_function_of_keyseq(k.first, nullptr, nullptr);
+            if (cur == &accept_suggestion || cur == &accept_line) rl_bind_keyseq(k.first, k.second);
+        }
+        suggestionKeys.clear();
     }
 }
 
@@ -140,7 +475,22 @@ ReadLine::ProposalItem ReadLine::allocProposalItem(const std::string &str, std::
 }
 
 void ReadLine::saveHistory() {
-    if (!_history_file.empty() && !_need_load_history && _appended > 0){
+    bool measure = metricsEnabled();
+    MetricsClock::time_point tm;
+    if (measure) tm = MetricsClock::now();
+    if (_shared_history) {
+        //only the writer persists and truncates the file, truncation uses
+        //readline, so it needs the global lock
+        bool flushed;
+        if (_config.history_limit) {
+            run_locked([&]{
+                flushed = _shared_history->flush(_config.history_limit);
+            });
+        } else {
+            flushed = _shared_history->flush();
+        }
+        if (!flushed) return;
+    } else if (!_history_file.empty() && !_need_load_history && _appended > 0){
         run_locked([&]{
             if (append_history(_appended, _history_file.c_str())) {
                 write_history(_history_file.c_str());
@@ -148,15 +498,40 @@ void ReadLine::saveHistory() {
             _appended = 0;
             if (_config.history_limit) history_truncate_file(_history_file.c_str(), _config.history_limit);
         });        
+    } else {
+        //nothing to save
+        return;
     }
+    if (measure) globalMetrics.history_save.record(elapsedNs(tm, MetricsClock::now()));
 }
 
 void ReadLine::initLibsInternal() {
+    //readBatch() splits pasted text to lines. Set before initialization,
+    //so the user's inputrc can still disable it
+    rl_variable_bind("enable-bracketed-paste", "on");
     rl_initialize ();
     using_history();
     rl_attempted_completion_function = &global_completion;
     rl_completion_word_break_hook = &completion_word_break_hook;
-
+    rl_redisplay_function = &global_redisplay;
+    rl_completion_display_matches_hook = &display_matches_hook;
+    if (pipe(printWakeFd) == 0) {
+        for (int fd: printWakeFd) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        rl_getc_function = &global_getc;
+    } else {
+        printWakeFd[0] = printWakeFd[1] = -1;
+    }
+    //keys are bound when an instance with autosuggest is attached
+    rl_add_defun("accept-suggestion", &accept_suggestion, -1);
+    //replace readline's paste handler unless the user has bound other function
+    for (Keymap map: {emacs_standard_keymap, vi_insertion_keymap}) {
+        if (rl_function_of_keyseq("\033[200~", map, nullptr) == &rl_bracketed_paste_begin) {
+            rl_bind_keyseq_in_map("\033[200~", &bracketed_paste, map);
+        }
+    }
 }
 
 static std::once_flag initLibsFlag;
@@ -170,6 +545,7 @@ void ReadLine::initLibs() {
 
 
 void ReadLine::restoreRLState() const {
+    bindSuggestionKeys(_config.autosuggest);
     if (_config.history_limit) {
         stifle_history(_config.history_limit);
     } else{
@@ -181,9 +557,24 @@ void ReadLine::restoreRLState() const {
         HISTORY_STATE st = {};
         history_set_history_state(&st);
     }
+    if (_need_load_snapshot) {
+        bool measure = metricsEnabled();
+        MetricsClock::time_point tm;
+        if (measure) tm = MetricsClock::now();
+        for (std::size_t i = 0, cnt = _snapshot->size(); i < cnt; ++i) {
+            add_history(_snapshot->entry(i));
+        }
+        _need_load_snapshot = false;
+        _snapshot_history_length = history_length;
+        if (measure) globalMetrics.history_load.record(elapsedNs(tm, MetricsClock::now()));
+    }
     if (_need_load_history) {
+        bool measure = metricsEnabled();
+        MetricsClock::time_point tm;
+        if (measure) tm = MetricsClock::now();
         read_history(_history_file.c_str());
         _need_load_history = false;
+        if (measure) globalMetrics.history_load.record(elapsedNs(tm, MetricsClock::now()));
     }
 }
 
@@ -196,16 +587,24 @@ ReadLine::~ReadLine() {
 
 bool ReadLine::read(std::string &line) {
     bool ok;
+    if (_config.script_fast_path) {
+        InstanceLock lk(*this, false);
+        LineReader *rd = scriptInput();
+        if (rd) {
+            ok = readScript(*rd, line, lk);
+            lk.unlock();
+            if (ok) postprocess(line);
+            return ok;
+        }
+    }
     run_locked([&]{
-       auto ln = readline(_config.prompt.c_str());
+       prepareHistory();
+       auto ln = callReadline();
        if (!ln) {
            ok = false;
        } else {
            line = ln;
-           if (filterHistory(line)) {
-               add_history(ln);
-               ++_appended;
-           }
+           if (filterHistory(line)) addHistoryLine(line);
            free(ln);
            ok = true;
        }
@@ -214,6 +613,358 @@ bool ReadLine::read(std::string &line) {
     return ok;
 }
 
+void ReadLine::addHistoryLine(const std::string &line) {
+    pushHistory(line.c_str(), line.size());
+    if (_shared_history) {
+        _shared_history->append(line.data(), line.size());
+    } else {
+        ++_appended;
+    }
+}
+
+void ReadLine::pushHistory(const char *line, std::size_t len) {
+    int prev_length = history_length;
+    add_history(line);
+    if (history_length == prev_length) {
+        //stifled history dropped the oldest entry, not indexed range moves
+        if (_index_begin) --_index_begin;
+        if (_index_end) --_index_end;
+    }
+    if (_history_index) _history_index->add(line, len);
+}
+
+void ReadLine::prepareHistory() {
+    if (_config.autosuggest && !_history_index) buildHistoryIndex();
+    if (_config.shared_history && !_shared_history && !_history_file.empty()) {
+        //lines not yet saved are kept in the history and must be saved first
+        saveHistory();
+        _shared_history = std::make_unique<SharedHistory>(_history_file);
+        rl_event_hook = &event_hook;
+    }
+    if (_shared_history) syncSharedHistory();
+}
+
+void ReadLine::syncSharedHistory() {
+    _shared_history->fetch([&](const char *line, std::size_t len){
+        pushHistory(line, len);
+    }, [&]{
+        //lines of other processes has been lost in the ring, but they are in the file
+        clear_history();
+        read_history(_history_file.c_str());
+        //positions of the snapshot's lines are not known anymore. The index
+        //is rebuilt, the reloaded lines can be more recent than indexed lines
+        _snapshot_history_length = -1;
+        if (_history_index) buildHistoryIndex();
+    });
+}
+
+///returns true if there is input ready to read
+static bool inputReady(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+int ReadLine::event_hook() {
+    if (curInst && curInst->_shared_history) curInst->syncSharedHistory();
+    //index the history while the user doesn't type
+    if (curInst) {
+        int fd = fileno(rl_instream?rl_instream:stdin);
+        while (!inputReady(fd) && curInst->indexHistoryStep()) {}
+    }
+    //when event hook is set, readline doesn't use rl_getc_function
+    if (printQueue.load(std::memory_order_relaxed) && !displayingProposals) {
+        auto rate = curInst?curInst->_config.print_redraw_rate:0;
+        auto now = std::chrono::steady_clock::now();
+        if (!rate || now - lastPrintRedraw >= std::chrono::milliseconds(1000/rate)) {
+            flushPrint(true);
+        }
+    }
+    return 0;
+}
+
+char *ReadLine::callReadline() {
+    {
+        std::lock_guard<std::mutex> _(printMx);
+        readingActive = true;
+    }
+    _suggestion_shown = false;
+    char *ln = readline(_config.prompt.c_str());
+    std::lock_guard<std::mutex> _(printMx);
+    readingActive = false;
+    flushPrint(false);
+    return ln;
+}
+
+void ReadLine::print(const std::string &text) {
+    enqueuePrint(new PrintItem{text, nullptr});
+}
+
+void ReadLine::print(std::string &&text) {
+    enqueuePrint(new PrintItem{std::move(text), nullptr});
+}
+
+void ReadLine::enqueuePrint(PrintItem *item) {
+    item->next = printQueue.load(std::memory_order_relaxed);
+    while (!printQueue.compare_exchange_weak(item->next, item, std::memory_order_release, std::memory_order_relaxed)) {}
+    {
+        //nobody is reading, print now. The global lock is not needed, it can
+        //be held by a thread blocked on non-interactive input
+        std::lock_guard<std::mutex> _(printMx);
+        if (!readingActive) {
+            flushPrint(false);
+            return;
+        }
+    }
+    if (printWakeFd[1] >= 0) {
+        char c = 0;
+        //pipe is non-blocking, if it is full, the reader is already woken
+        if (write(printWakeFd[1], &c, 1) < 0) {/* ignore */}
+    }
+}
+
+void ReadLine::flushPrint(bool redisplay) {
+    PrintItem *lst = printQueue.exchange(nullptr, std::memory_order_acquire);
+    if (!lst) return;
+    //reverse to print in order
+    PrintItem *ordered = nullptr;
+    while (lst) {
+        PrintItem *n = lst->next;
+        lst->next = ordered;
+        ordered = lst;
+        lst = n;
+    }
+    FILE *out = rl_outstream?rl_outstream:stdout;
+    if (redisplay) rl_clear_visible_line();
+    while (ordered) {
+        fwrite(ordered->text.data(), 1, ordered->text.size(), out);
+        fputc('\n', out);
+        PrintItem *n = ordered->next;
+        delete ordered;
+        ordered = n;
+    }
+    fflush(out);
+    if (redisplay) {
+        rl_forced_update_display();
+        lastPrintRedraw = std::chrono::steady_clock::now();
+    }
+}
+
+int ReadLine::global_getc(FILE *f) {
+    int fd = fileno(f);
+    while (true) {
+        //index the history while the user doesn't type
+        if (curInst && curInst->_history_index && curInst->_index_end > curInst->_index_begin && !inputReady(fd)
+                && !printQueue.load(std::memory_order_relaxed)) {
+            curInst->indexHistoryStep();
+            continue;
+        }
+        int timeout = -1;
+        bool wait_pipe = true;
+        if (printQueue.load(std::memory_order_relaxed) && !displayingProposals) {
+            auto rate = curInst?curInst->_config.print_redraw_rate:0;
+            auto now = std::chrono::steady_clock::now();
+            auto due = rate?lastPrintRedraw + std::chrono::milliseconds(1000/rate):now;
+            if (now >= due) {
+                flushPrint(true);
+            } else {
+                //coalesce - wait for input or for time of next redraw
+                timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count())+1;
+                wait_pipe = false;
+            }
+        }
+        struct pollfd fds[2] = {{fd, POLLIN, 0}, {printWakeFd[0], POLLIN, 0}};
+        int r = poll(fds, wait_pipe?2:1, timeout);
+        if (r < 0 && errno == EINTR) {
+            //signal (e.g. SIGWINCH) - let readline handle it and keep waiting,
+            //so queued texts are still printed
+            rl_check_signals();
+            continue;
+        }
+        //input or error - let readline handle it
+        if (r < 0 || fds[0].revents) return rl_getc(f);
+        if (r > 0 && (fds[1].revents & POLLIN)) {
+            char buff[256];
+            while (::read(printWakeFd[0], buff, sizeof(buff)) > 0) {}
+        }
+    }
+}
+
+///Splits lines from non-interactive input
+/**
+ * Input is read by large blocks, lines are returned as pointers to the buffer.
+ * Lines are separated by LF or CRLF
+ */
+class LineReader {
+public:
+    explicit LineReader(int fd):_fd(fd),_buffer(initialBufferSize) {}
+
+    ///Retrieve next line
+    /**
+     * @param line receives pointer to the line (without separator). The pointer
+     * is valid until next call
+     * @param len receives length of the line
+     * @retval true line read
+     * @retval false end of input
+     */
+    bool getLine(const char *&line, std::size_t &len) {
+        return getLine(line, len, true);
+    }
+
+    ///Retrieve next line
+    /**
+     * @param line receives pointer to the line (without separator). The pointer
+     * is valid until next call
+     * @param len receives length of the line
+     * @param wait wait for input, if there is no complete line in the buffer. If
+     * this is false, only lines already in the buffer are returned
+     * @retval true line read
+     * @retval false end of input, or no complete line in the buffer (when wait is false)
+     */
+    bool getLine(const char *&line, std::size_t &len, bool wait);
+
+    int fd() const {return _fd;}
+    ///end of input reached and all lines returned
+    bool eof() const {return _eof && _begin == _end;}
+
+protected:
+    static constexpr std::size_t initialBufferSize = 1024*1024;
+    int _fd;
+    std::vector<char> _buffer;
+    std::size_t _begin = 0;
+    std::size_t _end = 0;
+    std::size_t _scanned = 0;
+    bool _eof = false;
+};
+
+bool LineReader::getLine(const char *&line, std::size_t &len, bool wait) {
+    while (true) {
+        char *b = _buffer.data();
+        //_scanned avoids searching same data again when line is longer than the buffer
+        const char *sep = static_cast<const char *>(std::memchr(b+_scanned, '\n', _end-_scanned));
+        if (sep) {
+            line = b+_begin;
+            len = sep - line;
+            _begin = _scanned = sep - b + 1;
+            //CRLF separator, readline also accepts CR as end of line
+            if (len && line[len-1] == '\r') --len;
+            return true;
+        }
+        _scanned = _end;
+        if (_eof) {
+            if (_begin == _end) return false;
+            //last line without separator
+            line = b+_begin;
+            len = _end-_begin;
+            _begin = _scanned = _end;
+            if (line[len-1] == '\r') --len;
+            return true;
+        }
+        if (!wait) return false;
+        if (_begin) {
+            std::memmove(b, b+_begin, _end-_begin);
+            _end -= _begin;
+            _scanned -= _begin;
+            _begin = 0;
+        }
+        if (_end == _buffer.size()) {
+            _buffer.resize(_buffer.size()*2);
+            b = _buffer.data();
+        }
+        ssize_t r = ::read(_fd, b+_end, _buffer.size()-_end);
+        if (r > 0) _end += r;
+        else if (r == 0 || errno != EINTR) _eof = true;
+    }
+}
+
+LineReader *ReadLine::scriptInput() {
+    static std::unique_ptr<LineReader> reader;
+    static FILE *stream = nullptr;
+    static int interactive_fd = -1;
+    FILE *f = rl_instream?rl_instream:stdin;
+    int fd = fileno(f);
+    if (f != stream) {
+        //stream has been changed, the descriptor can be reused by other file
+        stream = f;
+        interactive_fd = -1;
+        reader.reset();
+    }
+    if (fd == interactive_fd) return nullptr;
+    //descriptor of the finished input can be reused by a new input
+    if (reader && reader->fd() == fd && !reader->eof()) return reader.get();
+    if (isatty(fd)) {
+        interactive_fd = fd;
+        return nullptr;
+    }
+    reader = std::make_unique<LineReader>(fd);
+    return reader.get();
+}
+
+bool ReadLine::readScript(LineReader &rd, std::string &line, InstanceLock &lk) {
+    const char *ln;
+    std::size_t len;
+    if (!rd.getLine(ln, len)) return false;
+    line.assign(ln, len);
+    if (_config.script_history && filterHistory(line)) {
+        lk.attach();
+        prepareHistory();
+        addHistoryLine(line);
+    }
+    return true;
+}
+
+bool ReadLine::readBatch(std::vector<std::string> &lines) {
+    std::size_t cnt = 0;
+    auto next = [&]() -> std::string & {
+        if (cnt == lines.size()) lines.emplace_back();
+        return lines[cnt++];
+    };
+    LineReader *rd = nullptr;
+    InstanceLock lk(*this, false);
+    if (_config.script_fast_path) rd = scriptInput();
+    if (rd) {
+        const char *ln;
+        std::size_t len;
+        //wait only for the first line
+        bool wait = true;
+        while (rd->getLine(ln, len, wait)) {
+            next().assign(ln, len);
+            wait = false;
+        }
+        if (_config.script_history && cnt) {
+            lk.attach();
+            prepareHistory();
+            for (std::size_t i = 0; i < cnt; ++i) {
+                if (filterHistory(lines[i])) addHistoryLine(lines[i]);
+            }
+        }
+    } else {
+        lk.attach();
+        prepareHistory();
+        auto ln = callReadline();
+        if (ln) {
+            //pasted text contains LF as line separator (see bracketed_paste())
+            const char *b = ln;
+            const char *e = ln + std::strlen(ln);
+            while (true) {
+                const char *sep = std::find(b, e, '\n');
+                next().assign(b, sep);
+                if (sep == e) break;
+                b = sep+1;
+                //separator at the end of pasted text doesn't start new line
+                if (b == e) break;
+            }
+            for (std::size_t i = 0; i < cnt; ++i) {
+                if (filterHistory(lines[i])) addHistoryLine(lines[i]);
+            }
+            free(ln);
+        }
+    }
+    lk.unlock();
+    lines.resize(cnt);
+    for (auto &l: lines) postprocess(l);
+    return cnt > 0;
+}
+
 ReadLine::ReadLine():_dirty(false) {
     initLibs();
 }
@@ -228,6 +979,14 @@ ReadLine::ReadLine(ReadLine &&other)
 ,_appended(other._appended)
 ,_completionList(std::move(other._completionList))
 ,_need_load_history(std::move(other._need_load_history))
+,_snapshot(std::move(other._snapshot))
+,_need_load_snapshot(other._need_load_snapshot)
+,_snapshot_history_length(other._snapshot_history_length)
+,_history_index(std::move(other._history_index))
+,_index_begin(other._index_begin)
+,_index_end(other._index_end)
+,_shared_history(std::move(other._shared_history))
+,_rule_metrics(std::move(other._rule_metrics))
 {
     other.detach();
     _state = other._state;
@@ -242,6 +1001,14 @@ ReadLine& ReadLine::operator =(ReadLine &&other) {
         _completionList = std::move(other._completionList);
         _need_load_history = other._need_load_history;
         clearHistory();
+        _history_index = std::move(other._history_index);
+        _index_begin = other._index_begin;
+        _index_end = other._index_end;
+        _shared_history = std::move(other._shared_history);
+        _rule_metrics = std::move(other._rule_metrics);
+        _snapshot = std::move(other._snapshot);
+        _need_load_snapshot = other._need_load_snapshot;
+        _snapshot_history_length = other._snapshot_history_length;
         _state = other._state;
         other._state = nullptr;
     }
@@ -268,6 +1035,31 @@ bool ReadLine::onComplete(const char *wholeLine, std::size_t start, std::size_t
     const char *word = wholeLine + start;
     auto sz = end - start;
     std::cmatch m;
+    if (metricsEnabled() && _rule_metrics) {
+        RuleMetrics *rm = _rule_metrics.get();
+        for (const auto &x: _completionList) {
+            auto t0 = MetricsClock::now();
+            bool match = std::regex_match<const char *>(wholeLine, wholeLine+start, m, x.pattern);
+            auto t1 = MetricsClock::now();
+            auto d = elapsedNs(t0, t1);
+            rm->regex_match.record(d);
+            globalMetrics.regex_match.record(d);
+            if (match) {
+                std::size_t cnt = 0;
+                ProposalCallback counter = [&](const std::string &s) {
+                    ++cnt;
+                    cb(s);
+                };
+                x.generator(word, sz, m, counter);
+                d = elapsedNs(t1, MetricsClock::now());
+                rm->generator.record(d);
+                rm->proposals.record(cnt);
+                globalMetrics.generator.record(d);
+            }
+            ++rm;
+        }
+        return true;
+    }
     for (const auto &x: _completionList) {
         if (std::regex_match<const char *>(wholeLine, wholeLine+start, m, x.pattern)) {
             x.generator(word, sz, m, cb);
@@ -279,11 +1071,16 @@ bool ReadLine::onComplete(const char *wholeLine, std::size_t start, std::size_t
 
 void ReadLine::setCompletionList(CompletionList &&list) {
     _completionList = std::move(list);
+    _rule_metrics.reset(new RuleMetrics[_completionList.size()]);
 }
 
 void ReadLine::setConfig(const ReadLineConfig &config) {
     detach();
     _config = config;
+    if (!_config.autosuggest) {
+        _history_index.reset();
+        _index_begin = _index_end = 0;
+    }
 }
 
 const ReadLineConfig &ReadLine::getConfig() const {
@@ -327,9 +1124,68 @@ const std::string& ReadLine::getHistoryFile() const {
     return _history_file;
 }
 
+bool ReadLine::loadSnapshot(const std::string &file) {
+    if (!_need_load_history) return false;
+    auto snap = HistorySnapshot::open(file, _history_file);
+    if (!snap) return false;
+    _snapshot = std::move(snap);
+    _need_load_history = false;
+    _need_load_snapshot = true;
+    return true;
+}
+
+bool ReadLine::saveSnapshot(const std::string &file) {
+    if (_history_file.empty()) return false;
+    saveHistory();
+    bool ok = false;
+    run_locked([&]{
+        //the snapshot is created from the file, as other processes could
+        //append lines which are not in this history. The history of this
+        //instance is replaced by a scratch history while the file is read
+        HISTORY_STATE *cur = history_get_history_state();
+        HISTORY_STATE scratch = {};
+        history_set_history_state(&scratch);
+        auto restore = [&]{
+            clear_history();
+            HISTORY_STATE *st = history_get_history_state();
+            rl_free(st->entries);
+            rl_free(st);
+            history_set_history_state(cur);
+            rl_free(cur);
+        };
+        try {
+            //retry if the file is changed while it is read
+            for (int attempt = 0; attempt < 3 && !ok; ++attempt) {
+                HistorySnapshot::Source before, after;
+                if (!HistorySnapshot::source(_history_file, before)) break;
+                clear_history();
+                if (before.size && read_history(_history_file.c_str()) != 0) break;
+                if (!HistorySnapshot::source(_history_file, after) || before != after) continue;
+                std::vector<const char *> entries;
+                HIST_ENTRY **lst = history_list();
+                if (lst) {
+                    for (HIST_ENTRY **it = lst; *it; ++it) entries.push_back((*it)->line);
+                }
+                ok = HistorySnapshot::write(file, before, entries);
+                if (!ok) break;
+            }
+        } catch (...) {
+            restore();
+            throw;
+        }
+        restore();
+    });
+    return ok;
+}
+
 
 void ReadLine::clearHistory() {
     detach();
+    if (_history_index) _history_index->clear();
+    _index_begin = _index_end = 0;
+    _snapshot.reset();
+    _need_load_snapshot = false;
+    _snapshot_history_length = -1;
     if (_state) {
         for (int i = 0; i < _state->length; ++i) {
             free_history_entry(_state->entries[i]);
@@ -361,6 +1217,120 @@ std::vector<std::string> ReadLine::getHistory() const {
     return out;
 }
 
+ReadLine::InstanceLock::InstanceLock(ReadLine &owner, bool attach)
+:_owner(owner)
+,_lk(gmx, std::defer_lock)
+,_measure(metricsEnabled())
+{
+    if (_measure) {
+        auto t0 = MetricsClock::now();
+        _lk.lock();
+        _locked = MetricsClock::now();
+        globalMetrics.lock_wait.record(elapsedNs(t0, _locked));
+    } else {
+        _lk.lock();
+    }
+    //the lock is released by _lk if attach throws
+    if (attach) this->attach();
+}
+
+void ReadLine::InstanceLock::attach() {
+    if (curInst == &_owner) return;
+    MetricsClock::time_point t0;
+    if (curInst) {
+        if (_measure) t0 = MetricsClock::now();
+        curInst->saveRLState();
+        if (_measure) globalMetrics.state_save.record(elapsedNs(t0, MetricsClock::now()));
+    }
+    curInst = &_owner;
+    _owner._dirty = true;
+    if (_measure) t0 = MetricsClock::now();
+    try {
+        _owner.restoreRLState();
+    } catch (...) {
+        //state is incomplete, next attach must restore it again
+        _owner._dirty = false;
+        curInst = nullptr;
+        throw;
+    }
+    if (_measure) globalMetrics.state_restore.record(elapsedNs(t0, MetricsClock::now()));
+}
+
+void ReadLine::InstanceLock::unlock() {
+    if (_measure) globalMetrics.lock_hold.record(elapsedNs(_locked, MetricsClock::now()));
+    _lk.unlock();
+}
+
+ReadLine::InstanceLock::~InstanceLock() {
+    if (_lk.owns_lock()) unlock();
+}
+
+void ReadLine::Histogram::record(std::uint64_t value) {
+    unsigned int b = 0;
+    while (b < bucketCount-1 && (value >> b)) ++b;
+    _buckets[b].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+    std::uint64_t m = _max.load(std::memory_order_relaxed);
+    while (m < value && !_max.compare_exchange_weak(m, value, std::memory_order_relaxed));
+}
+
+ReadLine::Histogram::Snapshot ReadLine::Histogram::snapshot() const {
+    Snapshot s;
+    s.count = _count.load(std::memory_order_relaxed);
+    s.sum = _sum.load(std::memory_order_relaxed);
+    s.max = _max.load(std::memory_order_relaxed);
+    for (unsigned int i = 0; i < bucketCount; ++i) {
+        s.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+    }
+    return s;
+}
+
+void ReadLine::Histogram::reset() {
+    _count = 0;
+    _sum = 0;
+    _max = 0;
+    for (auto &b: _buckets) b = 0;
+}
+
+void ReadLine::enableMetrics(bool enable) {
+    metricsOn.store(enable, std::memory_order_relaxed);
+}
+
+ReadLine::MetricsSnapshot ReadLine::getMetrics() const {
+    MetricsSnapshot s;
+    s.regex_match = globalMetrics.regex_match.snapshot();
+    s.generator = globalMetrics.generator.snapshot();
+    s.proposals = globalMetrics.proposals.snapshot();
+    s.common_prefix = globalMetrics.common_prefix.snapshot();
+    s.lock_wait = globalMetrics.lock_wait.snapshot();
+    s.lock_hold = globalMetrics.lock_hold.snapshot();
+    s.state_save = globalMetrics.state_save.snapshot();
+    s.state_restore = globalMetrics.state_restore.snapshot();
+    s.history_load = globalMetrics.history_load.snapshot();
+    s.history_save = globalMetrics.history_save.snapshot();
+    if (_rule_metrics) {
+        for (std::size_t i = 0; i < _completionList.size(); ++i) {
+            const RuleMetrics &rm = _rule_metrics[i];
+            s.rules.push_back({rm.regex_match.snapshot(), rm.generator.snapshot(), rm.proposals.snapshot()});
+        }
+    }
+    return s;
+}
+
+void ReadLine::resetMetrics() {
+    globalMetrics.regex_match.reset();
+    globalMetrics.generator.reset();
+    globalMetrics.proposals.reset();
+    globalMetrics.common_prefix.reset();
+    globalMetrics.lock_wait.reset();
+    globalMetrics.lock_hold.reset();
+    globalMetrics.state_save.reset();
+    globalMetrics.state_restore.reset();
+    globalMetrics.history_load.reset();
+    globalMetrics.history_save.reset();
+}
+
 class FileLookup {
 public:
     FileLookup(const std::string &rootPath, const std::string &pattern, bool pathname)
@@ -457,3 +1427,138 @@ inline void FileLookup::operator ()(const char *word, std::size_t word_size,
         this->operator ()(only_entry.c_str(), only_entry.length(), m, cb);
     }
 }
+
+///Index of executables in $PATH
+/**
+ * Keeps sorted and deduplicated list of executables. Before each lookup,
+ * modification time of each directory is checked and only modified directories
+ * are scanned again.
+ */
+class ExecutableIndex {
+public:
+
+    void operator()(const char *word, std::size_t word_size ,const std::cmatch &m, const ReadLine::ProposalCallback &cb);
+
+    static std::shared_ptr<ExecutableIndex> getInstance();
+
+protected:
+    struct Dir {
+        std::string path;
+        dev_t dev = 0;
+        ino_t ino = 0;
+        struct timespec mtime = {};
+        std::vector<std::string> names;
+    };
+
+    std::mutex _mx;
+    std::string _path_env;
+    std::vector<Dir> _dirs;
+    std::vector<std::string> _index;
+
+    ///checks directories, returns true if something changed
+    bool refresh();
+    static void scan(Dir &d);
+};
+
+std::shared_ptr<ExecutableIndex> ExecutableIndex::getInstance() {
+    static std::shared_ptr<ExecutableIndex> inst = std::make_shared<ExecutableIndex>();
+    return inst;
+}
+
+void ExecutableIndex::scan(Dir &d) {
+    d.names.clear();
+    DIR *dir = opendir(d.path.c_str());
+    if (!dir) return;
+    int dfd = dirfd(dir);
+    const struct dirent *e = readdir(dir);
+    while (e) {
+        const char *n = e->d_name;
+        if (n[0] != '.' || (n[1] && (n[1] != '.' || n[2]))) {
+            bool isfile = e->d_type == DT_REG;
+            if (e->d_type == DT_LNK || e->d_type == DT_UNKNOWN) {
+                struct stat st;
+                isfile = fstatat(dfd, n, &st, 0) == 0 && !S_ISDIR(st.st_mode);
+            }
+            if (isfile && faccessat(dfd, n, X_OK, 0) == 0) {
+                d.names.push_back(n);
+            }
+        }
+        e = readdir(dir);
+    }
+    closedir(dir);
+}
+
+bool ExecutableIndex::refresh() {
+    bool changed = false;
+    const char *path_env = getenv("PATH");
+    if (!path_env) path_env = "";
+    if (_path_env != path_env) {
+        _path_env = path_env;
+        std::vector<Dir> dirs;
+        std::size_t pos = 0;
+        while (pos <= _path_env.size()) {
+            auto sep = _path_env.find(':', pos);
+            if (sep == _path_env.npos) sep = _path_env.size();
+            //empty item means current directory
+            std::string p = sep == pos?std::string("."):_path_env.substr(pos, sep-pos);
+            pos = sep+1;
+            if (std::find_if(dirs.begin(), dirs.end(), [&](const Dir &d){return d.path == p;}) != dirs.end()) continue;
+            //reuse already scanned directory
+            auto iter = std::find_if(_dirs.begin(), _dirs.end(), [&](const Dir &d){return d.path == p;});
+            if (iter != _dirs.end()) {
+                dirs.push_back(std::move(*iter));
+            } else {
+                Dir d;
+                d.path = std::move(p);
+                dirs.push_back(std::move(d));
+            }
+        }
+        _dirs = std::move(dirs);
+        changed = true;
+    }
+    for (Dir &d: _dirs) {
+        struct stat st;
+        if (stat(d.path.c_str(), &st) != 0) {
+            if (!d.names.empty() || d.ino) {
+                d.names.clear();
+                d.ino = 0;
+                changed = true;
+            }
+            continue;
+        }
+        if (st.st_dev != d.dev || st.st_ino != d.ino
+                || st.st_mtim.tv_sec != d.mtime.tv_sec || st.st_mtim.tv_nsec != d.mtime.tv_nsec) {
+            d.dev = st.st_dev;
+            d.ino = st.st_ino;
+            d.mtime = st.st_mtim;
+            scan(d);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void ExecutableIndex::operator()(const char *word, std::size_t word_size, const std::cmatch &, const ReadLine::ProposalCallback &cb) {
+    std::lock_guard<std::mutex> _(_mx);
+    if (refresh()) {
+        _index.clear();
+        for (const Dir &d: _dirs) {
+            _index.insert(_index.end(), d.names.begin(), d.names.end());
+        }
+        std::sort(_index.begin(), _index.end());
+        _index.erase(std::unique(_index.begin(), _index.end()), _index.end());
+    }
+    auto iter = std::lower_bound(_index.begin(), _index.end(), word,
+            [&](const std::string &a, const char *b){return a.compare(0, word_size, b, word_size) < 0;});
+    while (iter != _index.end() && iter->compare(0, word_size, word, word_size) == 0) {
+        cb(*iter);
+        ++iter;
+    }
+}
+
+ReadLine::ProposalGenerator ReadLine::executableLookup() {
+    auto idx = ExecutableIndex::getInstance();
+    return ProposalGenerator(GenFn([idx](const char *word, std::size_t word_size ,const std::cmatch &m, const ProposalCallback &cb){
+        (*idx)(word, word_size, m, cb);
+    }));
+}
@@ -5,6 +5,12 @@
 #include <cstring>
 #include <regex>
 #include <mutex>
+#include <memory>
+#include <functional>
+#include <cstdio>
+#include <cstdint>
+#include <array>
+#include <chrono>
 
 
 struct ReadLineConfig {
@@ -12,10 +18,62 @@ struct ReadLineConfig {
     std::string prompt;
     ///Limit of history (0 = unlimited)
     unsigned int history_limit = 0;
+    ///Read lines directly, when the input is not a terminal
+    /**
+     * When input is not a terminal (piped stdin, script), readline is bypassed
+     * and lines are split directly from large input buffer. Prompt is not
+     * printed and completion is not available in this mode
+     */
+    bool script_fast_path = true;
+    ///Store lines read from non-interactive input to the history
+    bool script_history = false;
+    ///Share history with other processes using the same history file
+    /**
+     * Lines entered in other processes are visible immediately. The history
+     * file is written by one elected process, so lines are not lost when
+     * multiple processes exit
+     */
+    bool shared_history = false;
+    ///Maximum count of redraws per second caused by print() while reading
+    unsigned int print_redraw_rate = 20;
     ///word break characters for completion generator
     std::string word_break_chars = " \t\n\"\\'`@$><=;|&{(";
+    ///Show inline suggestion (in grey) completing the line from the history
+    /**
+     * Suggestion is accepted by right arrow or Ctrl+F at the end of the line.
+     * These keys are rebound only while an instance with autosuggest is attached.
+     *
+     * Index of the history is built incrementally from the most recent lines
+     * while the user doesn't type, so older lines are suggested after
+     * a while when the history is large
+     */
+    bool autosuggest = false;
+};
+
+///Configuration of ReadLine::recursiveFileLookup()
+struct RecursiveLookupConfig {
+    ///maximum depth of the walk (0 = unlimited, 1 = only root directory)
+    unsigned int max_depth = 0;
+    ///count of threads walking the tree (0 = hardware concurrency)
+    unsigned int threads = 0;
+    ///names (glob patterns) which are skipped, including whole directories
+    std::vector<std::string> ignore = {".git", ".svn", ".hg"};
+    ///fuzzy match - characters of the word must appear in the path in order.
+    ///Otherwise the word must be substring of the path
+    bool fuzzy = false;
+    ///maximum count of proposals (0 = unlimited), the best matches are returned
+    std::size_t max_results = 1000;
+    ///how long the list of files can be reused (seconds, 0 = always walk the tree)
+    unsigned int index_max_age = 300;
+    ///file where the list of files is stored to be reused between sessions (optional)
+    std::string index_file;
 };
 
+class HistoryIndex;
+class HistorySnapshot;
+class SharedHistory;
+class LineReader;
+
 ///ReadLine C++ wrapper around libreadline
 /**
  * Note it wraps only basic functions. However
@@ -98,6 +156,50 @@ public:
      */
     static ProposalGenerator fileLookup(const std::string &rootPath, const std::string &pattern=std::string(), bool pathname = true);
 
+    ///This generator generates names of executables found in directories of $PATH
+    /**
+     * The generator uses process wide index of executables. The index is built
+     * during first use, then only directories which has been modified
+     * are scanned again. Change of $PATH is also detected.
+     *
+     * @return generator object
+     */
+    static ProposalGenerator executableLookup();
+
+    ///This generator searches files in whole directory tree
+    /**
+     * The typed word is matched against paths relative to the root (substring
+     * or fuzzy match, case insensitive unless the word contains an uppercase
+     * letter). The tree is walked by a pool of threads. Proposals are ranked,
+     * the best first: the closest fuzzy match, match in the file name, match
+     * at start of the file name, the shortest path. Readline doesn't sort
+     * them, see keepProposalOrder().
+     *
+     * Proposals are not streamed while the tree is walked. The best matches
+     * are known only after the whole tree is walked, so they are passed to
+     * the callback at the end. Readline collects all proposals before they
+     * are displayed anyway.
+     *
+     * The list of files is kept in memory and optionally in the index file,
+     * so next completions don't need to walk the tree again, see RecursiveLookupConfig
+     *
+     * @param rootPath root path where to search
+     * @param cfg configuration
+     * @return generator object
+     */
+    static ProposalGenerator recursiveFileLookup(const std::string &rootPath, const RecursiveLookupConfig &cfg = RecursiveLookupConfig());
+
+    ///Keeps order of proposals of the current completion
+    /**
+     * Readline sorts proposals alphabetically. A generator which passes
+     * proposals ranked (the best first) calls this function, so readline
+     * keeps them in order they were generated. It applies to the whole
+     * list of the current completion, the next completion sorts again.
+     *
+     * @note must be called from a generator
+     */
+    static void keepProposalOrder();
+
     ///Pattern - uses regex, but we need to not have constructor explicit
     class Pattern: public std::regex {
     public:
@@ -149,9 +251,56 @@ public:
      * @retval false EOF (control+D) has been detected
      *
      * @note function holds global lock during its execution!
+     *
+     * @note if the input is not a terminal, function doesn't use readline,
+     * see ReadLineConfig::script_fast_path
+     *
+     * @note content of the variable is replaced, its capacity is reused. When
+     * the same variable is used for all reads, the function doesn't allocate
+     * memory (except allocations made by the readline library itself)
      */
     bool read(std::string &line);
 
+    ///Read all lines which are already available (global lock)
+    /**
+     * Reads one line through readline. If the line contains multiple lines
+     * (text pasted by bracketed paste), it is split to separate lines (LF,
+     * CRLF and CR are separators). Bracketed paste is enabled during
+     * initialization, unless it is disabled in the inputrc. For non-interactive
+     * input, it returns all complete lines available in the input buffer.
+     * Prompt is redrawn only once and history is updated under single lock
+     * for all lines.
+     *
+     * Lines typed ahead (not pasted) are still returned one per call. Pending
+     * terminal input can contain an incomplete line, reading it would block
+     * the lines which are already complete.
+     *
+     * @param lines receives lines. Content of the vector is replaced (existing
+     * strings are reused)
+     * @retval true at least one line read
+     * @retval false EOF (control+D) has been detected
+     *
+     * @note function holds global lock during its execution!
+     */
+    bool readBatch(std::vector<std::string> &lines);
+
+    ///Print line above the prompt (MT safe, doesn't block)
+    /**
+     * Can be called from any thread. Text is queued and printed by the thread
+     * which is reading the line. The edited line is removed, all queued
+     * texts are printed and the line is redrawn. Redraws are coalesced, see
+     * ReadLineConfig::print_redraw_rate.
+     *
+     * If no thread is reading, text is printed immediately, even if
+     * other thread waits for non-interactive input. While the proposals are
+     * displayed, texts are held back and printed after the paging ends.
+     *
+     * @param text text to print, new line is appended
+     */
+    static void print(const std::string &text);
+    ///Print line above the prompt (MT safe, doesn't block)
+    static void print(std::string &&text);
+
     ///Sets prompt
     void setPrompt(const std::string &prompt);
     ///Sets prompt
@@ -219,6 +368,40 @@ public:
     ///Gets name of history file
     const std::string &getHistoryFile() const;
 
+    ///Attach binary snapshot of the history
+    /**
+     * Snapshot is mapped to the memory, it is faster than loading text history
+     * file. It also contains prebuilt index for inline suggestions (see
+     * ReadLineConfig::autosuggest), which is used directly from the mapped file.
+     * History itself is created from the snapshot at time of the first attach.
+     * Readline keeps its own copy of the history, so this step still costs
+     * O(n) (one add_history() per entry), only parsing of the text file and
+     * building of the index are avoided. The snapshot is also checked on open
+     * (O(n)), a corrupted snapshot is refused.
+     *
+     * The function must be called after setHistoryFile() or setAppName()
+     * and before the history is loaded.
+     *
+     * @param file snapshot file
+     * @retval true snapshot attached
+     * @retval false snapshot doesn't exist or it is stale (history file has been
+     * changed after the snapshot was saved). History is loaded from the history file.
+     */
+    bool loadSnapshot(const std::string &file);
+
+    ///Save binary snapshot of the history (global lock)
+    /**
+     * Saves history file (see saveHistory()) and then writes the snapshot
+     * of the history file. The file is read again, so the snapshot contains
+     * also lines saved by other processes. The snapshot is valid until the
+     * history file is changed, so it should be saved when the application exits
+     *
+     * @param file snapshot file
+     * @retval true saved
+     * @retval false failed
+     */
+    bool saveSnapshot(const std::string &file);
+
     ///Retrieve history (detach)
     /**
      * @return vector of all strings in history ordered from least recent to most recent
@@ -246,6 +429,96 @@ public:
     
     void saveHistory();
 
+    ///Histogram with logarithmic buckets, lock free
+    /**
+     * Bucket 0 counts zero values, bucket i counts values in range <2^(i-1), 2^i),
+     * the last bucket counts also all greater values. Time is recorded in nanoseconds
+     */
+    class Histogram {
+    public:
+        static constexpr unsigned int bucketCount = 40;
+
+        ///Snapshot of the histogram
+        struct Snapshot {
+            std::uint64_t count = 0;
+            std::uint64_t sum = 0;
+            std::uint64_t max = 0;
+            std::array<std::uint64_t, bucketCount> buckets = {};
+        };
+
+        ///Record value
+        void record(std::uint64_t value);
+        ///Retrieve snapshot
+        Snapshot snapshot() const;
+        ///Reset the histogram
+        void reset();
+
+    protected:
+        std::atomic<std::uint64_t> _count{0};
+        std::atomic<std::uint64_t> _sum{0};
+        std::atomic<std::uint64_t> _max{0};
+        std::array<std::atomic<std::uint64_t>, bucketCount> _buckets = {};
+    };
+
+    ///Metrics of one completion rule
+    struct RuleMetrics {
+        ///time of regex_match (ns)
+        Histogram regex_match;
+        ///time of the generator (ns)
+        Histogram generator;
+        ///count of proposals generated by the generator
+        Histogram proposals;
+    };
+
+    ///Snapshot of metrics
+    struct MetricsSnapshot {
+        struct Rule {
+            Histogram::Snapshot regex_match;
+            Histogram::Snapshot generator;
+            Histogram::Snapshot proposals;
+        };
+        ///time of regex_match of all rules (ns)
+        Histogram::Snapshot regex_match;
+        ///time of all generators (ns)
+        Histogram::Snapshot generator;
+        ///count of proposals of whole completion
+        Histogram::Snapshot proposals;
+        ///time spent by computing common prefix of proposals (ns)
+        Histogram::Snapshot common_prefix;
+        ///time of waiting for the global lock (ns)
+        Histogram::Snapshot lock_wait;
+        ///time of holding the global lock by run_locked() (ns)
+        Histogram::Snapshot lock_hold;
+        ///time of saveRLState() during instance switch (ns)
+        Histogram::Snapshot state_save;
+        ///time of restoreRLState() during instance switch (ns)
+        Histogram::Snapshot state_restore;
+        ///time of loading history file (ns)
+        Histogram::Snapshot history_load;
+        ///time of saving history file (ns)
+        Histogram::Snapshot history_save;
+        ///metrics of rules of the completion list of the instance (same order)
+        std::vector<Rule> rules;
+    };
+
+    ///Enable or disable collecting of metrics (global)
+    /**
+     * Metrics are disabled by default. When disabled, cost of each
+     * measure point is single relaxed atomic load
+     */
+    static void enableMetrics(bool enable);
+    ///Returns true if metrics are enabled
+    static bool metricsEnabled() {return metricsOn.load(std::memory_order_relaxed);}
+    ///Retrieve metrics (MT safe, lock free)
+    /**
+     * @return global metrics and metrics of completion rules of this instance
+     *
+     * @note must not be called in parallel with setCompletionList()
+     */
+    MetricsSnapshot getMetrics() const;
+    ///Reset global metrics
+    static void resetMetrics();
+
 public: //overwrites
 
     ///Auto completion
@@ -310,6 +583,39 @@ public: //overwrites
      */
     virtual const char *completionWordBreakHook(const char *line, std::size_t size, std::size_t pos);
 
+    ///Generates inline suggestion for currently edited line
+    /**
+     * Called on every redisplay when ReadLineConfig::autosuggest is enabled
+     * and cursor is at the end of the line. Function must be fast, because
+     * it is called per keystroke.
+     *
+     * @param line current content of the line
+     * @param size size of the line in bytes
+     * @param suggestion receives text which is appended after the line (only the
+     * missing part)
+     * @retval true suggestion is available
+     * @retval false no suggestion
+     *
+     * @note default implementation returns the most recent history line starting by
+     * the content of the current line
+     */
+    virtual bool onSuggest(const char *line, std::size_t size, std::string &suggestion);
+
+    ///Displays list of proposals when completion is ambiguous
+    /**
+     * @param proposals array of proposals
+     * @param count count of proposals
+     *
+     * @note default implementation lays out only the page visible on the
+     * screen. Column widths are computed from entries of that page only, so
+     * the layout and output don't depend on total count of proposals (readline
+     * itself still measures all proposals once before the function is called).
+     * If there are more pages, user can page through them (space, enter or y
+     * shows next page, other key stops listing). Total count is reported in the
+     * paging prompt.
+     */
+    virtual void displayProposals(const char * const *proposals, std::size_t count);
+
 
 
 protected:
@@ -322,7 +628,27 @@ protected:
     mutable std::atomic<bool> _dirty;
     mutable struct _hist_state * _state = nullptr;
     mutable bool _need_load_history = false;
+    ///attached snapshot
+    std::shared_ptr<const HistorySnapshot> _snapshot;
+    ///history must be created from the snapshot
+    mutable bool _need_load_snapshot = false;
+    ///length of the history after it has been created from the snapshot
+    mutable int _snapshot_history_length = -1;
     std::string _prev_line;
+    ///prefix index of the history (created only when autosuggest is enabled)
+    std::unique_ptr<HistoryIndex> _history_index;
+    ///history entries in range <_index_begin, _index_end) are not indexed yet
+    int _index_begin = 0;
+    ///history entries in range <_index_begin, _index_end) are not indexed yet
+    int _index_end = 0;
+    ///currently displayed suggestion
+    std::string _suggestion;
+    ///true if the suggestion is visible on the screen
+    bool _suggestion_shown = false;
+    ///shared history (created only when shared history is enabled)
+    std::unique_ptr<SharedHistory> _shared_history;
+    ///metrics of completion rules (same order as the completion list)
+    std::unique_ptr<RuleMetrics[]> _rule_metrics;
 
     ///Save readline state
     /**
@@ -376,16 +702,35 @@ protected:
      */
     template<typename Fn>
     void run_locked(Fn &&fn) {
-        std::lock_guard<std::recursive_mutex> _(gmx);
-        if (curInst != this) {
-            if (curInst) curInst->saveRLState();
-            curInst = this;
-            curInst->_dirty = true;
-            restoreRLState();
-        }
+        InstanceLock _(*this);
         fn();
     }
 
+    ///Holds global lock and attaches the instance, see run_locked()
+    class InstanceLock {
+    public:
+        ///acquires the global lock
+        /**
+         * @param owner instance
+         * @param attach true to attach the instance now, false to attach
+         * it later by attach() (when the readline's state is needed)
+         */
+        explicit InstanceLock(ReadLine &owner, bool attach = true);
+        ~InstanceLock();
+        InstanceLock(const InstanceLock &) = delete;
+        InstanceLock &operator=(const InstanceLock &) = delete;
+        ///makes the owner the active instance (must be called while locked)
+        void attach();
+        ///releases the lock before destruction
+        void unlock();
+    protected:
+        ReadLine &_owner;
+        std::unique_lock<std::recursive_mutex> _lk;
+        ///time when lock was acquired (if metrics are enabled)
+        std::chrono::steady_clock::time_point _locked;
+        bool _measure;
+    };
+
     ///Allocate proposal item
     /**
      * Need to call this function to edit proposals
@@ -410,10 +755,75 @@ protected:
     static std::recursive_mutex gmx;
     ///current instance
     static ReadLine *curInst;
+    ///metrics are enabled
+    static std::atomic<bool> metricsOn;
     ///completion global function
     static char **global_completion (const char *, int start, int end);
     ///completion work break hook implementation
     static char *completion_word_break_hook();
+    ///display matches hook implementation
+    static void display_matches_hook(char **matches, int num_matches, int max_length);
+    ///redisplay function, which also draws suggestion
+    static void global_redisplay();
+    ///accepts suggestion or moves cursor forward
+    static int accept_suggestion(int count, int key);
+    ///removes suggestion from the screen and accepts the line
+    static int accept_line(int count, int key);
+    ///inserts bracketed paste, CRLF and CR are converted to single LF
+    static int bracketed_paste(int count, int key);
+    ///draws or clears suggestion after the line has been redisplayed
+    void drawSuggestion();
+    ///creates history index, only the most recent lines are indexed (must be called under run_locked())
+    void buildHistoryIndex();
+    ///indexes next block of older history lines (must be called under run_locked())
+    /**
+     * @retval true there are more lines to index
+     * @retval false whole history is indexed
+     */
+    bool indexHistoryStep();
+    ///binds or unbinds keys accepting suggestion (must be called under global lock)
+    static void bindSuggestionKeys(bool enable);
+    ///adds line to the history (must be called under run_locked())
+    void addHistoryLine(const std::string &line);
+    ///adds line to readline's history and to the index (must be called under run_locked())
+    void pushHistory(const char *line, std::size_t len);
+    ///prepares history before reading (must be called under run_locked())
+    /**
+     * Builds history index, fetches lines from shared history
+     */
+    void prepareHistory();
+    ///fetches lines from other processes to the history (must be called under run_locked())
+    void syncSharedHistory();
+    ///event hook - syncs shared history and prints queued texts while waiting for input
+    static int event_hook();
+    ///calls readline, handles printing while reading (must be called under run_locked())
+    char *callReadline();
+    ///queued text
+    struct PrintItem;
+    ///queue of texts to print (stack, reversed before printing)
+    static std::atomic<PrintItem *> printQueue;
+    ///enqueues text for print()
+    static void enqueuePrint(PrintItem *item);
+    ///prints queued texts (called by the reading thread, or under the output lock when nobody reads)
+    /**
+     * @param redisplay true if readline is active and the line must be redrawn
+     */
+    static void flushPrint(bool redisplay);
+    ///getc function, waits for input and for texts to print
+    static int global_getc(FILE *f);
+    ///reads line from non-interactive input
+    /**
+     * @param rd reader
+     * @param line receives the line
+     * @param lk held lock, the instance is attached only when the line is
+     * added to the history
+     */
+    bool readScript(LineReader &rd, std::string &line, InstanceLock &lk);
+    ///retrieves reader of non-interactive input (must be called under the global lock)
+    /**
+     * @return pointer to reader, or nullptr if the input is interactive
+     */
+    static LineReader *scriptInput();
     ///initializes libraries
     static void initLibs();
 private:
@@ -0,0 +1,451 @@
+#include "readlinepp.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+///Matches path against the typed word
+/**
+ * Substring match or fuzzy match (all characters of the word in order).
+ * Uses smart case - match is case insensitive, unless the word contains
+ * an uppercase letter.
+ *
+ * Each match has a score (lower is better). Ordered by: count of characters
+ * between matched characters (fuzzy only), match in the file name, match at
+ * start of the file name, length of the path
+ */
+class PathMatcher {
+public:
+    PathMatcher(const char *word, std::size_t word_size, bool fuzzy)
+        :_word(word, word_size), _fuzzy(fuzzy)
+        ,_icase(std::none_of(_word.begin(), _word.end(), [](char c){return std::isupper(static_cast<unsigned char>(c));})) {}
+
+    bool operator()(const char *path, std::size_t len, std::uint64_t &score) const {
+        const char *end = path+len;
+        //file name - last component, directories end by '/'
+        const char *name = end;
+        if (name != path && name[-1] == '/') --name;
+        while (name != path && name[-1] != '/') --name;
+        std::uint64_t gaps = 0;
+        const char *begin = end;
+        if (_word.empty()) {
+            begin = name;
+        } else if (_fuzzy) {
+            //leftmost end of the match, then the shortest match ending there
+            auto w = _word.begin();
+            const char *p = path;
+            for (; p != end && w != _word.end(); ++p) {
+                if (eq(*p, *w)) ++w;
+            }
+            if (w != _word.end()) return false;
+            auto rw = _word.rbegin();
+            begin = p;
+            while (rw != _word.rend()) {
+                --begin;
+                if (eq(*begin, *rw)) ++rw;
+            }
+            gaps = (p - begin) - _word.size();
+        } else {
+            auto cmp = [this](char a, char b){return eq(a,b);};
+            begin = std::search(path, end, _word.begin(), _word.end(), cmp);
+            if (begin == end) return false;
+            if (begin < name) {
+                //prefer occurrence in the file name
+                const char *b = std::search(name, end, _word.begin(), _word.end(), cmp);
+                if (b != end) begin = b;
+            }
+        }
+        score = (std::min<std::uint64_t>(gaps, 0xFFFFFF) << 40)
+                | (std::uint64_t(begin < name) << 33)
+                | (std::uint64_t(begin != name) << 32)
+                | std::min<std::uint64_t>(len, 0xFFFFFFFF);
+        return true;
+    }
+
+protected:
+    std::string _word;
+    bool _fuzzy;
+    bool _icase;
+
+    bool eq(char a, char b) const {
+        if (_icase) return std::tolower(static_cast<unsigned char>(a)) == b;
+        return a == b;
+    }
+};
+
+///Walks directory tree by a pool of threads
+/**
+ * Each thread has own queue of directories. Thread takes directories from
+ * back of its own queue, and if the queue is empty, it steals directory
+ * from front of queue of other thread
+ */
+class TreeWalker {
+public:
+    ///Receives found entries - called from worker threads
+    /**
+     * @param worker index of the worker thread
+     * @param path path relative to the root, directories end by '/'
+     */
+    using Sink = std::function<void(unsigned int worker, const std::string &path)>;
+
+    TreeWalker(const std::string &root, const RecursiveLookupConfig &cfg, unsigned int threads)
+        :_root(root), _cfg(cfg), _workers(threads) {
+        for (auto &w: _workers) w = std::make_unique<Worker>();
+    }
+
+    ~TreeWalker() {
+        cancel();
+        wait();
+    }
+
+    ///Starts walking
+    void start(Sink &&sink) {
+        _sink = std::move(sink);
+        push(0, {std::string(), 0});
+        for (unsigned int i = 0; i < _workers.size(); ++i) {
+            _threads.emplace_back([this, i]{worker(i);});
+        }
+    }
+
+    ///Waits for finish
+    void wait() {
+        for (auto &t: _threads) t.join();
+        _threads.clear();
+    }
+
+    ///Stops walking as soon as possible
+    void cancel() {
+        _cancel = true;
+        wakeIdle(true);
+    }
+
+    unsigned int workers() const {return static_cast<unsigned int>(_workers.size());}
+
+protected:
+
+    struct DirTask {
+        ///directory relative to the root (empty for root, otherwise ends by '/')
+        std::string path;
+        ///depth of the directory
+        unsigned int depth;
+    };
+
+    struct Worker {
+        std::mutex mx;
+        std::deque<DirTask> queue;
+    };
+
+    std::string _root;
+    RecursiveLookupConfig _cfg;
+    std::vector<std::unique_ptr<Worker> > _workers;
+    std::vector<std::thread> _threads;
+    ///count of directories queued or being scanned
+    std::atomic<std::size_t> _pending{0};
+    ///count of directories in queues
+    std::atomic<std::size_t> _queued{0};
+    ///count of workers waiting for a directory
+    std::atomic<unsigned int> _idle{0};
+    std::mutex _idle_mx;
+    std::condition_variable _idle_cond;
+    std::atomic<bool> _cancel{false};
+    Sink _sink;
+
+    void push(unsigned int w, DirTask &&t) {
+        ++_pending;
+        bool surplus;
+        {
+            std::lock_guard<std::mutex> _(_workers[w]->mx);
+            _workers[w]->queue.push_back(std::move(t));
+            //the worker takes one directory itself, others can steal the rest
+            surplus = _workers[w]->queue.size() > 1;
+        }
+        ++_queued;
+        if (surplus && _idle) wakeIdle(false);
+    }
+
+    void wakeIdle(bool all) {
+        //lock pairs with the check of the waiting worker, so the wakeup is not lost
+        {
+            std::lock_guard<std::mutex> _(_idle_mx);
+        }
+        if (all) _idle_cond.notify_all();
+        else _idle_cond.notify_one();
+    }
+
+    bool pop(unsigned int w, DirTask &t) {
+        {
+            Worker &own = *_workers[w];
+            std::lock_guard<std::mutex> _(own.mx);
+            if (!own.queue.empty()) {
+                t = std::move(own.queue.back());
+                own.queue.pop_back();
+                --_queued;
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i < _workers.size(); ++i) {
+            Worker &other = *_workers[(w + i) % _workers.size()];
+            std::lock_guard<std::mutex> _(other.mx);
+            if (!other.queue.empty()) {
+                t = std::move(other.queue.front());
+                other.queue.pop_front();
+                --_queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker(unsigned int w) {
+        DirTask t;
+        while (!_cancel) {
+            if (pop(w, t)) {
+                scanDir(w, t);
+                //the last directory is done, wake others to finish
+                if (--_pending == 0) wakeIdle(true);
+            } else if (_pending == 0) {
+                break;
+            } else {
+                //other workers are scanning, wait for new directory
+                ++_idle;
+                std::unique_lock<std::mutex> lk(_idle_mx);
+                _idle_cond.wait(lk, [&]{return _cancel || _pending == 0 || _queued != 0;});
+                --_idle;
+            }
+        }
+    }
+
+    bool ignored(const char *name) const {
+        for (const auto &p: _cfg.ignore) {
+            if (fnmatch(p.c_str(), name, 0) == 0) return true;
+        }
+        return false;
+    }
+
+    void processEntry(unsigned int w, const DirTask &t, int dfd, const char *name, unsigned char type, std::string &path) {
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) return;
+        if (ignored(name)) return;
+        bool isdir = type == DT_DIR;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            isdir = fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        path = t.path;
+        path.append(name);
+        if (isdir) path.push_back('/');
+        _sink(w, path);
+        if (isdir && (_cfg.max_depth == 0 || t.depth + 1 < _cfg.max_depth)) {
+            push(w, {path, t.depth+1});
+        }
+    }
+
+    void scanDir(unsigned int w, const DirTask &t) {
+        std::string full = _root;
+        if (!full.empty() && full.back() != '/') full.push_back('/');
+        full.append(t.path);
+        int dfd = open(full.empty()?".":full.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dfd < 0) return;
+        std::string path;
+#ifdef __linux__
+        //getdents64 reads many entries per syscall and doesn't allocate
+        struct linux_dirent64 {
+            ino64_t d_ino;
+            off64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[1];
+        };
+        alignas(linux_dirent64) char buffer[32768];
+        while (!_cancel) {
+            long n = syscall(SYS_getdents64, dfd, buffer, sizeof(buffer));
+            if (n <= 0) break;
+            for (long pos = 0; pos < n;) {
+                auto e = reinterpret_cast<const linux_dirent64 *>(buffer+pos);
+                processEntry(w, t, dfd, e->d_name, e->d_type, path);
+                pos += e->d_reclen;
+            }
+        }
+        close(dfd);
+#else
+        DIR *dir = fdopendir(dfd);
+        if (!dir) {
+            close(dfd);
+            return;
+        }
+        const struct dirent *e = readdir(dir);
+        while (e && !_cancel) {
+            processEntry(w, t, dfd, e->d_name, e->d_type, path);
+            e = readdir(dir);
+        }
+        closedir(dir);
+#endif
+    }
+};
+
+class RecursiveFileLookup {
+public:
+    RecursiveFileLookup(const std::string &rootPath, const RecursiveLookupConfig &cfg)
+        :_root(rootPath), _cfg(cfg), _cache(std::make_shared<Cache>()) {}
+
+    void operator()(const char *word, std::size_t word_size ,const std::cmatch &m, const ReadLine::ProposalCallback &cb) const;
+
+protected:
+    struct Cache {
+        std::mutex mx;
+        std::vector<std::string> paths;
+        std::chrono::steady_clock::time_point built;
+        bool valid = false;
+    };
+
+    std::string _root;
+    RecursiveLookupConfig _cfg;
+    std::shared_ptr<Cache> _cache;
+
+    bool loadIndex(std::vector<std::string> &paths) const;
+    void saveIndex(const std::vector<std::string> &paths) const;
+    std::string indexHeader() const;
+};
+
+std::string RecursiveFileLookup::indexHeader() const {
+    return "readlinepp-index 1 " + _root;
+}
+
+bool RecursiveFileLookup::loadIndex(std::vector<std::string> &paths) const {
+    struct stat st;
+    if (stat(_cfg.index_file.c_str(), &st) != 0) return false;
+    if (time(nullptr) - st.st_mtime > static_cast<time_t>(_cfg.index_max_age)) return false;
+    std::ifstream f(_cfg.index_file);
+    std::string ln;
+    if (!std::getline(f, ln) || ln != indexHeader()) return false;
+    paths.clear();
+    while (std::getline(f, ln)) paths.push_back(std::move(ln));
+    return true;
+}
+
+void RecursiveFileLookup::saveIndex(const std::vector<std::string> &paths) const {
+    //write to temporary file and rename, so other process never see incomplete index
+    std::string tmp = _cfg.index_file + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream f(tmp, std::ios::trunc);
+        if (!f) return;
+        f << indexHeader() << '\n';
+        for (const auto &p: paths) f << p << '\n';
+        if (!f) {
+            f.close();
+            unlink(tmp.c_str());
+            return;
+        }
+    }
+    if (rename(tmp.c_str(), _cfg.index_file.c_str()) != 0) unlink(tmp.c_str());
+}
+
+///Keeps best matches (lowest score), count is limited
+class BestMatches {
+public:
+    explicit BestMatches(std::size_t limit):_limit(limit) {}
+
+    void add(std::uint64_t score, const std::string &path) {
+        if (_limit && _items.size() == _limit) {
+            //heap has the worst match on the top
+            if (!better(score, path, _items.front())) return;
+            std::pop_heap(_items.begin(), _items.end(), cmp);
+            _items.back() = {score, path};
+        } else {
+            _items.push_back({score, path});
+        }
+        std::push_heap(_items.begin(), _items.end(), cmp);
+    }
+
+    void merge(BestMatches &&other) {
+        for (auto &x: other._items) add(x.first, x.second);
+    }
+
+    ///passes matches to the callback, best first
+    void emit(const ReadLine::ProposalCallback &cb) {
+        ReadLine::keepProposalOrder();
+        std::sort_heap(_items.begin(), _items.end(), cmp);
+        for (const auto &x: _items) cb(x.second);
+    }
+
+protected:
+    using Item = std::pair<std::uint64_t, std::string>;
+    std::size_t _limit;
+    std::vector<Item> _items;
+
+    static bool better(std::uint64_t score, const std::string &path, const Item &item) {
+        return score < item.first || (score == item.first && path < item.second);
+    }
+    static bool cmp(const Item &a, const Item &b) {
+        return better(a.first, a.second, b);
+    }
+};
+
+void RecursiveFileLookup::operator()(const char *word, std::size_t word_size ,const std::cmatch &, const ReadLine::ProposalCallback &cb) const {
+    PathMatcher match(word, word_size, _cfg.fuzzy);
+    bool use_index = _cfg.index_max_age > 0;
+    std::uint64_t score;
+
+    std::lock_guard<std::mutex> _(_cache->mx);
+    if (use_index) {
+        auto now = std::chrono::steady_clock::now();
+        bool fresh = _cache->valid && now - _cache->built < std::chrono::seconds(_cfg.index_max_age);
+        if (!fresh && !_cfg.index_file.empty() && loadIndex(_cache->paths)) {
+            _cache->built = now;
+            _cache->valid = fresh = true;
+        }
+        if (fresh) {
+            BestMatches best(_cfg.max_results);
+            for (const auto &p: _cache->paths) {
+                if (match(p.data(), p.size(), score)) best.add(score, p);
+            }
+            best.emit(cb);
+            return;
+        }
+    }
+
+    //best matches can be selected only when whole tree is walked
+    unsigned int threads = _cfg.threads?_cfg.threads:std::max(std::thread::hardware_concurrency(), 1U);
+    TreeWalker walker(_root, _cfg, threads);
+    //all paths are collected per worker to build the index
+    std::vector<std::vector<std::string> > collected(use_index?threads:0);
+    std::vector<BestMatches> found(threads, BestMatches(_cfg.max_results));
+
+    walker.start([&](unsigned int w, const std::string &path){
+        if (use_index) collected[w].push_back(path);
+        std::uint64_t sc;
+        if (match(path.data(), path.size(), sc)) found[w].add(sc, path);
+    });
+    walker.wait();
+    for (unsigned int i = 1; i < threads; ++i) found[0].merge(std::move(found[i]));
+    found[0].emit(cb);
+
+    if (use_index) {
+        auto &paths = _cache->paths;
+        paths.clear();
+        for (auto &c: collected) {
+            paths.insert(paths.end(), std::make_move_iterator(c.begin()), std::make_move_iterator(c.end()));
+        }
+        std::sort(paths.begin(), paths.end());
+        _cache->built = std::chrono::steady_clock::now();
+        _cache->valid = true;
+        if (!_cfg.index_file.empty()) saveIndex(paths);
+    }
+}
+
+ReadLine::ProposalGenerator ReadLine::recursiveFileLookup(const std::string &rootPath, const RecursiveLookupConfig &cfg) {
+    return ProposalGenerator(GenFn(RecursiveFileLookup(rootPath, cfg)));
+}
@@ -0,0 +1,341 @@
+#include "sharedhistory.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <readline/history.h>
+
+static constexpr std::uint32_t shmMagic = 0x52484953; //RHIS
+static constexpr std::uint32_t shmVersion = 1;
+static constexpr std::uint32_t slotCount = 8192;
+static constexpr std::size_t slotDataSize = 496;
+///slot is being written
+static constexpr std::uint64_t slotBusy = ~std::uint64_t(0);
+///how long the fetch waits on uncommitted slot before it is skipped (ms)
+static constexpr std::uint64_t stuckTimeout = 1000;
+///interval of the background writer
+static constexpr auto writerInterval = std::chrono::seconds(1);
+///how long the append waits for other writer to persist full ring (ms)
+static constexpr std::uint64_t fullTimeout = 2000;
+///byte of the shared memory object locked by all attached processes (shared)
+static constexpr off_t usersLockByte = 0;
+///byte of the shared memory object locked while the history file is written (shared) or truncated (exclusive)
+static constexpr off_t fileLockByte = 1;
+
+struct SharedHistory::Header {
+    ///0 - not initialized, 1 - initializing, 2 - ready
+    std::atomic<std::uint32_t> state;
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t slot_count;
+    ///sequence number of next line
+    std::atomic<std::uint64_t> head;
+    ///all lines below this sequence number are stored in the file
+    std::atomic<std::uint64_t> persisted;
+    ///pid of elected writer (0 - none)
+    std::atomic<std::int32_t> writer;
+};
+
+struct SharedHistory::Slot {
+    ///sequence number + 1 of the line in the slot, or slotBusy
+    std::atomic<std::uint64_t> seq;
+    std::int32_t pid;
+    std::uint32_t len;
+    char data[slotDataSize];
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "lock free 64-bit atomic required");
+
+static std::uint64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//open file description locks are shared by threads and released when the process dies
+static bool lockByte(int fd, short type, off_t byte, bool wait) {
+    struct flock fl = {};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    while (fcntl(fd, wait?F_OFD_SETLKW:F_OFD_SETLK, &fl) != 0) {
+        if (!wait || errno != EINTR) return false;
+    }
+    return true;
+}
+
+static void unlockByte(int fd, off_t byte) {
+    lockByte(fd, F_UNLCK, byte, false);
+}
+
+SharedHistory::SharedHistory(const std::string &history_file)
+:_file(history_file)
+,_pid(getpid())
+{
+    //name of the shared memory is derived from path of the history file (FNV-1a)
+    std::uint64_t h = 14695981039346656037ULL;
+    for (char c: history_file) {
+        h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/readlinepp_%u_%016llx", static_cast<unsigned>(getuid()),
+            static_cast<unsigned long long>(h));
+    _name = name;
+
+    _map_size = sizeof(Header) + sizeof(Slot) * slotCount;
+    int fd = -1;
+    struct stat st;
+    for (int attempt = 0; attempt < 3 && fd < 0; ++attempt) {
+        fd = shm_open(name, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+        if (fd < 0) return;
+        //attached processes hold shared lock, the last one removes the object
+        if (!lockByte(fd, F_RDLCK, usersLockByte, true) || fstat(fd, &st) != 0) {
+            close(fd);
+            return;
+        }
+        if (st.st_nlink == 0) {
+            //object has been just removed by the last process, create new one
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) return;
+    if (static_cast<std::size_t>(st.st_size) < _map_size) {
+        //extending is safe, if other process already extended, nothing happens
+        if (ftruncate(fd, _map_size) != 0) {
+            close(fd);
+            return;
+        }
+    }
+    void *m = mmap(nullptr, _map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    Header *hdr = static_cast<Header *>(m);
+    std::uint32_t s = 0;
+    if (hdr->state.compare_exchange_strong(s, 1)) {
+        hdr->magic = shmMagic;
+        hdr->version = shmVersion;
+        hdr->slot_count = slotCount;
+        hdr->head.store(0);
+        hdr->persisted.store(0);
+        hdr->writer.store(0);
+        hdr->state.store(2, std::memory_order_release);
+    } else {
+        //other process is initializing, wait for it
+        auto limit = nowMs() + stuckTimeout;
+        while (hdr->state.load(std::memory_order_acquire) != 2 && nowMs() < limit) {
+            std::this_thread::yield();
+        }
+    }
+    if (hdr->state.load(std::memory_order_acquire) != 2 || hdr->magic != shmMagic
+            || hdr->version != shmVersion || hdr->slot_count != slotCount) {
+        munmap(m, _map_size);
+        close(fd);
+        return;
+    }
+    _fd = fd;
+    _hdr = hdr;
+    _slots = reinterpret_cast<Slot *>(static_cast<char *>(m) + sizeof(Header));
+    //lines which are not yet in the file must be fetched
+    _cursor = _hdr->persisted.load(std::memory_order_acquire);
+    _writer = std::thread([this]{writerWorker();});
+}
+
+SharedHistory::~SharedHistory() {
+    if (!_hdr) return;
+    {
+        std::lock_guard<std::mutex> _(_mx);
+        _stop = true;
+    }
+    _cond.notify_all();
+    _writer.join();
+    flush();
+    std::int32_t me = _pid;
+    _hdr->writer.compare_exchange_strong(me, 0);
+    //the last process removes the object, unless some lines are not in the file
+    if (_hdr->persisted.load(std::memory_order_acquire) == _hdr->head.load(std::memory_order_acquire)
+            && lockByte(_fd, F_WRLCK, usersLockByte, false)) {
+        shm_unlink(_name.c_str());
+    }
+    munmap(_hdr, _map_size);
+    close(_fd);
+}
+
+void SharedHistory::append(const char *line, std::size_t len) {
+    std::uint64_t seq;
+    if (!_hdr || len > slotDataSize || !reserve(seq)) {
+        //line doesn't fit to the slot, or the ring is full
+        std::string data(line, len);
+        data.push_back('\n');
+        writeFile(data);
+        return;
+    }
+    Slot &slot = _slots[seq % slotCount];
+    slot.seq.store(slotBusy, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.pid = _pid;
+    slot.len = static_cast<std::uint32_t>(len);
+    std::memcpy(slot.data, line, len);
+    slot.seq.store(seq+1, std::memory_order_release);
+}
+
+bool SharedHistory::reserve(std::uint64_t &seq) {
+    std::uint64_t limit = 0;
+    while (true) {
+        seq = _hdr->head.load(std::memory_order_acquire);
+        if (seq - _hdr->persisted.load(std::memory_order_acquire) < slotCount) {
+            if (_hdr->head.compare_exchange_weak(seq, seq+1, std::memory_order_acq_rel)) {
+                _ring_stalled = false;
+                return true;
+            }
+            continue;
+        }
+        //ring is full of lines which are not in the file, they must not be overwritten
+        bool writer = flush();
+        if (_hdr->head.load(std::memory_order_acquire) - _hdr->persisted.load(std::memory_order_acquire) < slotCount) {
+            continue;
+        }
+        //other process is the writer (or a line is being written), wait, but not forever
+        if (_ring_stalled && !writer) return false;
+        auto now = nowMs();
+        if (!limit) limit = now + fullTimeout;
+        if (now >= limit) {
+            _ring_stalled = true;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+bool SharedHistory::readSlot(std::uint64_t seq, std::string &line, int &pid) const {
+    const Slot &slot = _slots[seq % slotCount];
+    std::uint64_t s1 = slot.seq.load(std::memory_order_acquire);
+    if (s1 != seq+1) return false;
+    pid = slot.pid;
+    std::uint32_t len = std::min<std::uint32_t>(slot.len, slotDataSize);
+    line.assign(slot.data, len);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    //slot could be overwritten during copying
+    return slot.seq.load(std::memory_order_relaxed) == s1;
+}
+
+void SharedHistory::fetch(const LineCallback &cb, const ReloadCallback &reload) {
+    if (!_hdr) return;
+    std::uint64_t head = _hdr->head.load(std::memory_order_acquire);
+    if (head - _cursor > slotCount) {
+        //lines has been overwritten before they were fetched. Overwritten lines
+        //are always in the file, so the history is reloaded and only lines which
+        //are not in the file yet are fetched (lines persisted by other writer
+        //during reload can be fetched twice)
+        std::lock_guard<std::mutex> _(_mx);
+        _cursor = _hdr->persisted.load(std::memory_order_acquire);
+        reload();
+        _own_until = head;
+    }
+    std::string line;
+    int pid;
+    while (_cursor < head) {
+        if (readSlot(_cursor, line, pid)) {
+            if (pid != _pid || _cursor < _own_until) cb(line.c_str(), line.size());
+        } else if (shouldWait(_cursor, _fetch_stuck)) {
+            break;
+        }
+        ++_cursor;
+    }
+}
+
+bool SharedHistory::shouldWait(std::uint64_t seq, Stuck &stuck) const {
+    std::uint64_t s = _slots[seq % slotCount].seq.load(std::memory_order_acquire);
+    //slot has been already overwritten, line is lost
+    if (s != slotBusy && s > seq+1) return false;
+    //line is being written, try it later, but don't wait forever,
+    //the writing process could die
+    auto now = nowMs();
+    if (stuck.pos != seq) {
+        stuck.pos = seq;
+        stuck.since = now;
+        return true;
+    }
+    return now - stuck.since < stuckTimeout;
+}
+
+bool SharedHistory::elect() {
+    std::int32_t w = _hdr->writer.load(std::memory_order_acquire);
+    if (w == _pid) return true;
+    if (w != 0 && (kill(w, 0) == 0 || errno != ESRCH)) return false;
+    return _hdr->writer.compare_exchange_strong(w, _pid);
+}
+
+void SharedHistory::persist() {
+    std::uint64_t pos = _hdr->persisted.load(std::memory_order_acquire);
+    std::uint64_t head = _hdr->head.load(std::memory_order_acquire);
+    if (head - pos > slotCount) pos = head - slotCount;
+    std::string data;
+    std::string line;
+    int pid;
+    while (pos < head) {
+        if (readSlot(pos, line, pid)) {
+            data.append(line);
+            data.push_back('\n');
+        } else if (shouldWait(pos, _persist_stuck)) {
+            break;
+        }
+        ++pos;
+    }
+    if (!data.empty()) writeFile(data);
+    _hdr->persisted.store(pos, std::memory_order_release);
+}
+
+void SharedHistory::writeFile(const std::string &data) {
+    //file must be opened under the lock, truncation replaces the file
+    bool locked = _fd >= 0 && lockByte(_fd, F_RDLCK, fileLockByte, true);
+    int fd = open(_file.c_str(), O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+    if (fd < 0) {
+        if (locked) unlockByte(_fd, fileLockByte);
+        return;
+    }
+    const char *p = data.data();
+    std::size_t remain = data.size();
+    while (remain) {
+        ssize_t r = write(fd, p, remain);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        p += r;
+        remain -= r;
+    }
+    close(fd);
+    if (locked) unlockByte(_fd, fileLockByte);
+}
+
+bool SharedHistory::flush(unsigned int limit) {
+    if (!_hdr) return false;
+    std::lock_guard<std::mutex> _(_mx);
+    if (!elect()) return false;
+    persist();
+    if (limit) {
+        //truncation rewrites the file, appends of other processes must wait
+        if (lockByte(_fd, F_WRLCK, fileLockByte, true)) {
+            history_truncate_file(_file.c_str(), limit);
+            unlockByte(_fd, fileLockByte);
+        }
+    }
+    return true;
+}
+
+void SharedHistory::writerWorker() {
+    std::unique_lock<std::mutex> lk(_mx);
+    while (!_cond.wait_for(lk, writerInterval, [&]{return _stop;})) {
+        if (elect()) persist();
+    }
+}
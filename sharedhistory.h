@@ -0,0 +1,138 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+
+///History shared between processes through shared memory ring buffer
+/**
+ * The ring is identified by path to the history file, so all processes using
+ * the same history file share the same ring. New lines are appended to the ring
+ * without locking and other processes can fetch them immediately.
+ *
+ * Lines from the ring are persisted to the history file by one elected writer
+ * process. The writer is elected automatically, if the previous writer exits
+ * or dies, other process takes this role. Persisting is done asynchronously
+ * by a background thread, and finally during destruction.
+ *
+ * Lines are never overwritten in the ring before they are stored in the file.
+ * When the ring is full, the writer persists the lines first, other processes
+ * wait for the writer (and if it doesn't respond, they append the line to the
+ * file directly). A process which doesn't fetch lines in time, reloads
+ * the history file.
+ *
+ * Lines longer than slot of the ring are appended to the history file directly.
+ *
+ * The shared memory object (/dev/shm/readlinepp_<uid>_<hash>) is removed
+ * by the last process which detaches, if all lines are stored in the file.
+ * If a process crashes, the object is left and it is reused next time.
+ *
+ * Object is not MT safe except the internal writer thread.
+ */
+class SharedHistory {
+public:
+
+    ///Callback receiving lines from other processes
+    /**
+     * @param line null terminated line
+     * @param len length of the line
+     */
+    using LineCallback = std::function<void(const char *line, std::size_t len)>;
+
+    ///Callback which reloads the history from the history file
+    using ReloadCallback = std::function<void()>;
+
+    ///Open (or create) shared ring for the history file
+    /**
+     * @param history_file path to history file
+     */
+    explicit SharedHistory(const std::string &history_file);
+    ///Destructor - persists pending lines if possible
+    ~SharedHistory();
+
+    SharedHistory(const SharedHistory &) = delete;
+    SharedHistory &operator=(const SharedHistory &) = delete;
+
+    ///Returns true if shared memory is available
+    bool valid() const {return _hdr != nullptr;}
+
+    ///Append line
+    /**
+     * @param line line
+     * @param len length of the line
+     */
+    void append(const char *line, std::size_t len);
+
+    ///Fetch lines appended by other processes since the last call
+    /**
+     * @param cb callback called for each line
+     * @param reload callback called when lines were overwritten in the ring
+     * before they were fetched. It must replace the history by content of
+     * the history file. Then lines which are not in the file yet are passed
+     * to the cb (including lines of this process)
+     */
+    void fetch(const LineCallback &cb, const ReloadCallback &reload);
+
+    ///Persist pending lines now, if this process can be the writer
+    /**
+     * @param limit if not zero, history file is truncated to given count of lines.
+     * Function history_truncate_file() of readline is used, so the caller must
+     * hold the global lock of readline
+     * @retval true this process is the writer, lines has been persisted
+     * @retval false other process is the writer
+     */
+    bool flush(unsigned int limit = 0);
+
+protected:
+
+    struct Header;
+    struct Slot;
+
+    std::string _file;
+    ///name of the shared memory object
+    std::string _name;
+    ///descriptor of the shared memory object (holds locks)
+    int _fd = -1;
+    Header *_hdr = nullptr;
+    Slot *_slots = nullptr;
+    std::size_t _map_size = 0;
+    int _pid;
+    ///sequence number of next line to fetch
+    std::uint64_t _cursor = 0;
+    ///lines of this process are fetched below this sequence number (after reload)
+    std::uint64_t _own_until = 0;
+    ///the writer didn't persist full ring in time, lines go to the file directly
+    bool _ring_stalled = false;
+
+    ///tracks waiting on uncommitted slot
+    struct Stuck {
+        ///position of the slot
+        std::uint64_t pos = ~std::uint64_t(0);
+        ///time when waiting started (ms)
+        std::uint64_t since = 0;
+    };
+    Stuck _fetch_stuck;
+    Stuck _persist_stuck;
+
+    std::mutex _mx;
+    std::condition_variable _cond;
+    bool _stop = false;
+    std::thread _writer;
+
+    ///reads slot, returns false if the slot doesn't contain committed line of given sequence
+    bool readSlot(std::uint64_t seq, std::string &line, int &pid) const;
+    ///returns true, if the reader should wait for uncommitted slot
+    bool shouldWait(std::uint64_t seq, Stuck &stuck) const;
+    ///reserves slot for new line, returns false if the ring is full
+    bool reserve(std::uint64_t &seq);
+    ///tries to become elected writer
+    bool elect();
+    ///writes lines to the file (must be writer)
+    void persist();
+    ///appends data to the history file
+    void writeFile(const std::string &data);
+    ///background writer
+    void writerWorker();
+};